@@ -0,0 +1,276 @@
+#!/usr/bin/env node
+"use strict";
+
+// Load test: run optimize() over a corpus at increasing concurrency levels,
+// and dumpdct() synchronously, recording throughput, latency percentiles,
+// event loop delay and memory growth.
+//
+// node --expose-gc bench.js [options]
+//   --concurrency 1,2,4,8  levels to sweep (default 1 .. 4x cpus)
+//   --duration 5           seconds per level
+//   --corpus dir           use the .jpg files in dir instead of generating
+//   --options '{...}'      JSON options passed to optimize()
+//   --output file.json     where to write the results (default stdout only)
+//
+// The worker pool has UV_THREADPOOL_SIZE threads (4 by default); set it in
+// the environment to tune it.
+
+const os = require("os");
+const path = require("path");
+const {execSync} = require("child_process");
+const {monitorEventLoopDelay} = require("perf_hooks");
+const {promises: {readFile, readdir, writeFile}} = require("fs");
+const jopt = require("./");
+
+function parseArgs(argv) {
+  const cpus = os.cpus().length;
+  const concurrency = [];
+  for (let c = 1; c <= cpus * 4; c *= 2) {
+    concurrency.push(c);
+  }
+  const args = {
+    concurrency,
+    duration: 5,
+    corpus: null,
+    options: {},
+    output: null,
+  };
+  for (let i = 0; i < argv.length; i += 2) {
+    const [key, value] = [argv[i], argv[i + 1]];
+    if (value === undefined) {
+      throw new Error(`No value for ${key}`);
+    }
+    switch (key) {
+    case "--concurrency":
+      args.concurrency = value.split(",").map(Number);
+      if (args.concurrency.some(c => !Number.isInteger(c) || c < 1)) {
+        throw new Error("Invalid concurrency");
+      }
+      break;
+
+    case "--duration":
+      args.duration = Number(value);
+      if (!(args.duration > 0)) {
+        throw new Error("Invalid duration");
+      }
+      break;
+
+    case "--corpus":
+      args.corpus = value;
+      break;
+
+    case "--options":
+      args.options = JSON.parse(value);
+      break;
+
+    case "--output":
+      args.output = value;
+      break;
+
+    default:
+      throw new Error(`Unknown option ${key}`);
+    }
+  }
+  return args;
+}
+
+async function loadCorpus(dir) {
+  const files = (await readdir(dir)).
+    filter(f => /\.jpe?g$/i.test(f)).
+    sort();
+  const rv = [];
+  for (const file of files) {
+    rv.push({
+      name: file,
+      data: await readFile(path.join(dir, file), {encoding: null}),
+    });
+  }
+  if (!rv.length) {
+    throw new Error(`No jpegs in ${dir}`);
+  }
+  return rv;
+}
+
+// Derive images of various sizes, qualities and modes from test.jpg,
+// using the module itself: DCT scaled previews re-encode the image.
+async function generateCorpus() {
+  const base = await readFile(
+    path.join(__dirname, "test.jpg"), {encoding: null});
+  const rv = [{name: "test.jpg", data: base}];
+  for (const scale of [2, 4, 8]) {
+    for (const quality of [50, 75, 95]) {
+      const {preview} = await jopt(base, {preview: {scale, quality}});
+      rv.push({name: `test-${scale}-q${quality}.jpg`, data: preview});
+      const progressive = await jopt(preview, {effort: 1});
+      rv.push({name: `test-${scale}-q${quality}-p.jpg`, data: progressive});
+    }
+  }
+  rv.push({
+    name: "test-p.jpg",
+    data: await jopt(base, {effort: 1}),
+  });
+  return rv;
+}
+
+function percentile(sorted, p) {
+  if (!sorted.length) {
+    return 0;
+  }
+  const idx = Math.min(sorted.length - 1, Math.ceil(p * sorted.length) - 1);
+  return sorted[Math.max(0, idx)];
+}
+
+function collect() {
+  if (global.gc) {
+    global.gc();
+  }
+  return process.memoryUsage();
+}
+
+function ms(ns) {
+  return Number(ns) / 1e6;
+}
+
+// Run op with the given number of calls in flight for duration seconds.
+// Synchronous ops yield to the event loop after each call.
+async function run(name, corpus, concurrency, duration, op, sync = false) {
+  const latencies = [];
+  let bytes = 0;
+  let next = 0;
+  let rssMax = 0;
+  const delay = monitorEventLoopDelay({resolution: 10});
+  const sampler = setInterval(() => {
+    rssMax = Math.max(rssMax, process.memoryUsage().rss);
+  }, 50);
+
+  const before = collect();
+  delay.enable();
+  const start = process.hrtime.bigint();
+  const deadline = start + BigInt(Math.round(duration * 1e9));
+  const worker = async () => {
+    while (process.hrtime.bigint() < deadline) {
+      const {data} = corpus[next++ % corpus.length];
+      const t = process.hrtime.bigint();
+      await op(data);
+      latencies.push(ms(process.hrtime.bigint() - t));
+      bytes += data.length;
+      if (sync) {
+        await new Promise(resolve => setImmediate(resolve));
+      }
+    }
+  };
+  const workers = [];
+  for (let i = 0; i < concurrency; ++i) {
+    workers.push(worker());
+  }
+  await Promise.all(workers);
+  const seconds = ms(process.hrtime.bigint() - start) / 1000;
+  delay.disable();
+  clearInterval(sampler);
+  const after = collect();
+
+  latencies.sort((a, b) => a - b);
+  const sum = latencies.reduce((sum, l) => sum + l, 0);
+  return {
+    op: name,
+    concurrency,
+    count: latencies.length,
+    seconds,
+    throughput: latencies.length / seconds,
+    bytesPerSecond: bytes / seconds,
+    latency: {
+      mean: sum / (latencies.length || 1),
+      p50: percentile(latencies, 0.5),
+      p99: percentile(latencies, 0.99),
+      p999: percentile(latencies, 0.999),
+      max: latencies[latencies.length - 1] || 0,
+    },
+    eventLoopDelay: {
+      mean: delay.mean / 1e6,
+      p50: delay.percentile(50) / 1e6,
+      p99: delay.percentile(99) / 1e6,
+      max: delay.max / 1e6,
+    },
+    memory: {
+      rssBefore: before.rss,
+      rssAfter: after.rss,
+      rssMax: Math.max(rssMax, after.rss),
+      externalBefore: before.external,
+      externalAfter: after.external,
+      externalGrowth: after.external - before.external,
+    },
+  };
+}
+
+function revision() {
+  try {
+    return execSync("git rev-parse HEAD", {
+      cwd: __dirname,
+      encoding: "utf8",
+      stdio: ["ignore", "pipe", "ignore"],
+    }).trim();
+  }
+  catch (ex) {
+    return null;
+  }
+}
+
+function report(r) {
+  const fmt = (v, d = 2) => v.toFixed(d).padStart(9);
+  console.log(
+    r.op.padEnd(9), String(r.concurrency).padStart(4),
+    fmt(r.throughput, 1), "/s",
+    "p50", fmt(r.latency.p50), "p99", fmt(r.latency.p99),
+    "p999", fmt(r.latency.p999), "ms",
+    "loop p99", fmt(r.eventLoopDelay.p99), "ms",
+    "rss", fmt(r.memory.rssMax / 1048576, 1), "MB",
+    "ext +", fmt(r.memory.externalGrowth / 1048576, 1), "MB");
+}
+
+async function main() {
+  const args = parseArgs(process.argv.slice(2));
+  const corpus = args.corpus ?
+    await loadCorpus(args.corpus) :
+    await generateCorpus();
+  if (!global.gc) {
+    console.error("Run with --expose-gc for stable memory figures");
+  }
+
+  const results = [];
+  for (const concurrency of args.concurrency) {
+    const r = await run(
+      "optimize", corpus, concurrency, args.duration,
+      data => jopt(data, args.options));
+    report(r);
+    results.push(r);
+  }
+  // Synchronous, so there is only ever one in flight anyway
+  const r = await run(
+    "dumpdct", corpus, 1, args.duration,
+    data => jopt.dumpdct(data, () => {}), true);
+  report(r);
+  results.push(r);
+
+  const rv = {
+    date: new Date().toISOString(),
+    revision: revision(),
+    node: process.version,
+    platform: `${os.platform()} ${os.release()} ${os.arch()}`,
+    cpus: os.cpus().length,
+    cpu: os.cpus()[0].model,
+    threadpool: Number(process.env.UV_THREADPOOL_SIZE) || 4,
+    versions: jopt.versions,
+    options: args.options,
+    corpus: corpus.map(({name, data}) => ({name, size: data.length})),
+    duration: args.duration,
+    results,
+  };
+  if (args.output) {
+    await writeFile(args.output, JSON.stringify(rv, null, 2));
+  }
+}
+
+main().then(() => process.exit(0)).catch(err => {
+  console.error(err.message || err);
+  process.exit(1);
+});
@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <limits>
 #include <vector>
 
 #include "binding.hh"
@@ -34,12 +35,69 @@ constexpr const size_t TAG_ICC_LEN = sizeof(TAG_ICC) - 1;
 constexpr const char TAG_IPTC[] = "\x1c";
 constexpr const size_t TAG_IPTC_LEN = sizeof(TAG_IPTC) - 1;
 
+constexpr const char TAG_JFIF[] = "JFIF\0";
+constexpr const size_t TAG_JFIF_LEN = sizeof(TAG_JFIF) - 1;
+
+constexpr const char TAG_ADOBE[] = "Adobe";
+constexpr const size_t TAG_ADOBE_LEN = sizeof(TAG_ADOBE) - 1;
+
+constexpr const char TAG_MPF[] = "MPF\0";
+constexpr const size_t TAG_MPF_LEN = sizeof(TAG_MPF) - 1;
+
+// GContainer directory (e.g. Ultra HDR) items referring to their size
+constexpr const char TAG_ITEM_LENGTH[] = "Item:Length";
+constexpr const size_t TAG_ITEM_LENGTH_LEN = sizeof(TAG_ITEM_LENGTH) - 1;
+
+// Markers jpeglib.h does not define
+constexpr const int M_SOI = 0xd8;
+constexpr const int M_SOS = 0xda;
+
+// MP Entry tag of the MP Index IFD, of type UNDEFINED
+constexpr const uint32_t MPF_ENTRY = 0xb002;
+constexpr const uint32_t TIFF_UNDEFINED = 7;
+
+// jpeg_natural_order, which libjpeg does not export publicly
+constexpr const int natural_order[DCTSIZE2] = {
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+// For 8-bit samples
+constexpr const int MAX_COEF_BITS = 10;
+
+// The IJG sample quantization tables (jcparam.c), in natural order
+constexpr const unsigned int std_luminance_quant_tbl[DCTSIZE2] = {
+    16, 11, 10, 16, 24,  40,  51,  61,  12, 12, 14, 19, 26,  58,  60,  55,
+    14, 13, 16, 24, 40,  57,  69,  56,  14, 17, 22, 29, 51,  87,  80,  62,
+    18, 22, 37, 56, 68,  109, 103, 77,  24, 35, 55, 64, 81,  104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99,
+};
+constexpr const unsigned int std_chrominance_quant_tbl[DCTSIZE2] = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+};
+
 uint8_t* BufferData(Local<ArrayBufferView>& buffer)
 {
   auto d = buffer->Buffer()->GetContents().Data();
   return reinterpret_cast<uint8_t*>(d) + buffer->ByteOffset();
 }
 
+// What an output buffer holds on to
+size_t Footprint(const jpegoptim::MemoryDestination& dest)
+{
+  return dest.Capacity();
+}
+
+size_t Footprint(const std::vector<uint8_t>& bytes)
+{
+  return bytes.capacity();
+}
+
 template<class T>
 class Holder {
   Persistent<Object> persistent_;
@@ -62,7 +120,7 @@ class Holder {
   explicit Holder(Isolate* isolate, Local<Object>& o, std::unique_ptr<T>&& dest)
       : persistent_(isolate, o),
         dest_{std::move(dest)},
-        self_{sizeof(*this) + sizeof(T) + dest_->Capacity()}
+        self_{sizeof(*this) + sizeof(T) + Footprint(*dest_)}
   {
     persistent_.SetWeak(this, WeakCallback, WeakCallbackType::kParameter);
     isolate->AdjustAmountOfExternalAllocatedMemory(self_);
@@ -80,6 +138,355 @@ class Holder {
   }
 };
 
+// Visit all blocks in the order a single sequential scan codes them, or only
+// those of the iMCU rows from first to last (exclusive).
+// Interleaved scans pad partial MCUs at the right and bottom edges with dummy
+// blocks, which jctrans.c fills with the previous DC and no AC; those are
+// visited as well.
+template<typename F>
+void ForEachBlock(
+    jpegoptim::Decompress& dec,
+    jvirt_barray_ptr* coefs,
+    F&& fn,
+    JDIMENSION first = 0,
+    JDIMENSION last = std::numeric_limits<JDIMENSION>::max())
+{
+  const auto info = reinterpret_cast<j_common_ptr>(&dec);
+  if (dec.num_components == 1) {
+    const auto comp = dec.comp_info;
+    const auto v = static_cast<JDIMENSION>(comp->v_samp_factor);
+    for (JDIMENSION row = first * v;
+         row < comp->height_in_blocks && row / v < last;
+         ++row) {
+      const auto blocks = dec.mem->access_virt_barray(
+          info, coefs[0], row, 1, static_cast<boolean>(FALSE));
+      for (JDIMENSION col = 0; col < comp->width_in_blocks; ++col) {
+        fn(0, blocks[0][col]);
+      }
+    }
+    return;
+  }
+
+  const auto mcuw = static_cast<JDIMENSION>(dec.max_h_samp_factor * DCTSIZE);
+  const auto mcuh = static_cast<JDIMENSION>(dec.max_v_samp_factor * DCTSIZE);
+  const auto cols = (dec.image_width + mcuw - 1) / mcuw;
+  const auto rows = (dec.image_height + mcuh - 1) / mcuh;
+  JBLOCKARRAY buffers[MAX_COMPONENTS]{};
+  JBLOCK dummy{};
+  for (JDIMENSION row = first; row < std::min(rows, last); ++row) {
+    for (int ci = 0; ci < dec.num_components; ++ci) {
+      const auto v = static_cast<JDIMENSION>(dec.comp_info[ci].v_samp_factor);
+      buffers[ci] = dec.mem->access_virt_barray(
+          info, coefs[ci], row * v, v, static_cast<boolean>(FALSE));
+    }
+    for (JDIMENSION col = 0; col < cols; ++col) {
+      for (int ci = 0; ci < dec.num_components; ++ci) {
+        const auto& comp = dec.comp_info[ci];
+        const auto h = static_cast<JDIMENSION>(comp.h_samp_factor);
+        const auto v = static_cast<JDIMENSION>(comp.v_samp_factor);
+        auto width = h;
+        if (col + 1 == cols && comp.width_in_blocks % h != 0) {
+          width = comp.width_in_blocks % h;
+        }
+        auto height = v;
+        if (row + 1 == rows && comp.height_in_blocks % v != 0) {
+          height = comp.height_in_blocks % v;
+        }
+        JCOEF prevdc = 0;
+        for (JDIMENSION y = 0; y < v; ++y) {
+          JDIMENSION x = 0;
+          if (y < height) {
+            for (; x < width; ++x) {
+              const auto block = buffers[ci][y][col * h + x];
+              prevdc = block[0];
+              fn(ci, block);
+            }
+          }
+          for (; x < h; ++x) {
+            dummy[0] = prevdc;
+            fn(ci, dummy);
+          }
+        }
+      }
+    }
+  }
+}
+
+// Bits needed for a (positive) magnitude, i.e. its category
+inline int MagnitudeBits(unsigned int value)
+{
+  return value == 0 ? 0 : 32 - __builtin_clz(value);
+}
+
+// Emit the symbols and extra bits of a block the same way jchuff.c does.
+// The non-zero coefficients are noted in a mask in zigzag order first, so
+// runs of zeros are skipped over at once rather than coefficient by
+// coefficient, like libjpeg-turbo's SIMD encoders do.
+template<typename Sink>
+inline void
+CodeBlock(j_common_ptr info, const JCOEF* block, int& lastdc, Sink& sink)
+{
+  int temp = block[0] - lastdc;
+  int temp2 = temp;
+  lastdc = block[0];
+  if (temp < 0) {
+    temp = -temp;
+    temp2--;
+  }
+  int nbits = MagnitudeBits(temp);
+  if (nbits > MAX_COEF_BITS + 1) {
+    ERREXIT(info, JERR_BAD_DCT_COEF);
+  }
+  sink.dc(nbits);
+  sink.put(temp2, nbits);
+
+  uint64_t nonzero = 0;
+  for (int k = 1; k < DCTSIZE2; k++) {
+    nonzero |= static_cast<uint64_t>(block[natural_order[k]] != 0) << k;
+  }
+  int last = 0;
+  while (nonzero != 0) {
+    const auto k = __builtin_ctzll(nonzero);
+    nonzero &= nonzero - 1;
+    int run = k - last - 1;
+    last = k;
+    while (run > 15) {
+      sink.ac(0xf0);
+      run -= 16;
+    }
+    temp = block[natural_order[k]];
+    temp2 = temp;
+    if (temp < 0) {
+      temp = -temp;
+      temp2--;
+    }
+    nbits = MagnitudeBits(temp);
+    if (nbits > MAX_COEF_BITS) {
+      ERREXIT(info, JERR_BAD_DCT_COEF);
+    }
+    sink.ac((run << 4) + nbits);
+    sink.put(temp2, nbits);
+  }
+  if (last < DCTSIZE2 - 1) {
+    sink.ac(0);
+  }
+}
+
+struct StatsSink {
+  long* dcfreq{nullptr};
+  long* acfreq{nullptr};
+
+  inline void dc(int symbol)
+  {
+    dcfreq[symbol]++;
+  }
+
+  inline void ac(int symbol)
+  {
+    acfreq[symbol]++;
+  }
+
+  inline void put(int /* unused */, int /* unused */) {}
+};
+
+// Counts the bytes the entropy coder would emit, including 0xFF stuffing
+class BitCounter {
+  const jpegoptim::HuffmanTable* dc_{nullptr};
+  const jpegoptim::HuffmanTable* ac_{nullptr};
+  size_t bytes_{0};
+  uint32_t buffer_{0};
+  int bits_{0};
+
+ public:
+  inline void Select(
+      const jpegoptim::HuffmanTable* dc, const jpegoptim::HuffmanTable* ac)
+  {
+    dc_ = dc;
+    ac_ = ac;
+  }
+
+  inline void dc(int symbol)
+  {
+    put(static_cast<int>(dc_->codes[symbol]), dc_->sizes[symbol]);
+  }
+
+  inline void ac(int symbol)
+  {
+    put(static_cast<int>(ac_->codes[symbol]), ac_->sizes[symbol]);
+  }
+
+  inline void put(int value, int nbits)
+  {
+    if (nbits == 0) {
+      return;
+    }
+    buffer_ = (buffer_ << nbits) | (value & ((1u << nbits) - 1));
+    bits_ += nbits;
+    while (bits_ >= 8) {
+      bits_ -= 8;
+      bytes_ += ((buffer_ >> bits_) & 0xff) == 0xff ? 2 : 1;
+    }
+    buffer_ &= (1u << bits_) - 1;
+  }
+
+  // Pad with 1-bits like flush_bits, and return the final count
+  inline size_t Flush()
+  {
+    put(0x7f, 7);
+    buffer_ = 0;
+    bits_ = 0;
+    return bytes_;
+  }
+};
+
+// Counts symbols, magnitude bits and zero runs per component
+struct AnalysisSink {
+  jpegoptim::ComponentStats* stats{nullptr};
+  bool zrl{false};
+
+  inline void dc(int symbol)
+  {
+    stats->dc[symbol]++;
+    stats->blocks++;
+    zrl = false;
+  }
+
+  inline void ac(int symbol)
+  {
+    stats->ac[symbol]++;
+    if (symbol == 0xf0) {
+      zrl = true;  // run continues
+      return;
+    }
+    if (symbol == 0 || (symbol >> 4) != 0 || zrl) {
+      stats->runs++;
+    }
+    if (symbol != 0) {
+      stats->nonzero++;
+    }
+    zrl = false;
+  }
+
+  inline void put(int /* unused */, int nbits)
+  {
+    stats->extraBits += nbits;
+  }
+};
+
+// The IJG quality setting (jpeg_set_quality) whose scaled sample tables come
+// closest to the given ones; chroma may be null.
+int EstimateQuality(const JQUANT_TBL* luma, const JQUANT_TBL* chroma)
+{
+  unsigned int max = 0;
+  for (const auto tbl : {luma, chroma}) {
+    for (int i = 0; tbl != nullptr && i < DCTSIZE2; ++i) {
+      max = std::max(max, static_cast<unsigned int>(tbl->quantval[i]));
+    }
+  }
+  const auto limit = max > 255 ? 32767u : 255u;  // force_baseline or not
+
+  int rv = 0;
+  auto best = std::numeric_limits<unsigned long>::max();
+  for (int quality = 1; quality <= 100; ++quality) {
+    const auto scale = static_cast<unsigned int>(
+        quality < 50 ? 5000 / quality : 200 - quality * 2);
+    const auto error = [&](const JQUANT_TBL* tbl, const unsigned int* std) {
+      unsigned long rv = 0;
+      for (int i = 0; tbl != nullptr && i < DCTSIZE2; ++i) {
+        const auto q =
+            std::min(std::max((std[i] * scale + 50) / 100, 1u), limit);
+        const auto actual = static_cast<unsigned int>(tbl->quantval[i]);
+        rv += q > actual ? q - actual : actual - q;
+      }
+      return rv;
+    };
+    const auto e = error(luma, std_luminance_quant_tbl) +
+        error(chroma, std_chrominance_quant_tbl);
+    if (e < best) {
+      best = e;
+      rv = quality;
+    }
+  }
+  return rv;
+}
+
+size_t MarkerBytes(const std::vector<jpegoptim::Marker>& markers)
+{
+  size_t rv = 0;
+  for (const auto& m : markers) {
+    rv += 4 + m.length;  // marker, length, payload
+  }
+  return rv;
+}
+
+// Walk the rest of an image from a position past its frame header, i.e.
+// within entropy coded data or between marker segments, and return the
+// position just past EOI (or len if there is none).
+size_t ImageEnd(const uint8_t* data, const size_t len, size_t pos)
+{
+  if (pos >= 2 && pos <= len && data[pos - 2] == 0xff &&
+      data[pos - 1] == JPEG_EOI) {
+    return pos;
+  }
+  while (pos < len) {
+    const auto ff =
+        static_cast<const uint8_t*>(memchr(data + pos, 0xff, len - pos));
+    if (ff == nullptr) {
+      break;
+    }
+    pos = ff - data + 1;
+    while (pos < len && data[pos] == 0xff) {
+      ++pos;  // fill bytes
+    }
+    if (pos >= len) {
+      break;
+    }
+    const auto m = data[pos++];
+    if (m == 0 || (m >= JPEG_RST0 && m <= JPEG_RST0 + 7)) {
+      continue;  // stuffed byte or restart marker, in entropy coded data
+    }
+    if (m == JPEG_EOI) {
+      return pos;
+    }
+    if (pos + 2 > len) {
+      break;
+    }
+    pos += (static_cast<size_t>(data[pos]) << 8u) | data[pos + 1];
+  }
+  return len;
+}
+
+MaybeLocal<Object> ToBuffer(
+    std::unique_ptr<jpegoptim::MemoryDestination>&& dest)
+{
+  auto isolate = Isolate::GetCurrent();
+  auto buf = node::Buffer::New(
+      isolate, reinterpret_cast<char*>(dest->Data()), dest->Length(),
+      jpegoptim::MemoryDestination::destroy, nullptr);
+  if (buf.IsEmpty()) {
+    return buf;
+  }
+
+  auto lbuf = buf.ToLocalChecked();
+  new Holder<jpegoptim::MemoryDestination>(isolate, lbuf, std::move(dest));
+  return lbuf;
+}
+
+MaybeLocal<Object> ToBuffer(std::unique_ptr<std::vector<uint8_t>>&& bytes)
+{
+  auto isolate = Isolate::GetCurrent();
+  auto buf = node::Buffer::New(
+      isolate, reinterpret_cast<char*>(bytes->data()), bytes->size(),
+      jpegoptim::MemoryDestination::destroy, nullptr);
+  if (buf.IsEmpty()) {
+    return buf;
+  }
+
+  auto lbuf = buf.ToLocalChecked();
+  new Holder<std::vector<uint8_t>>(isolate, lbuf, std::move(bytes));
+  return lbuf;
+}
+
 }  // namespace
 
 namespace jpegoptim {
@@ -112,32 +519,92 @@ void ErrorManager::error(j_common_ptr info)
   longjmp(err->setjmp_buffer, 1);  // NOLINT
 }
 
-Compress::Compress(Decompress& dec, size_t memhint)
-    : jpeg_compress_struct{},
-      dst_{std::make_unique<ManagedMemoryDestination>(memhint)}
+void Compress::Defaults(Decompress& dec)
 {
   jpeg_create_compress(this);
 
   err = dec.err;
   jpeg_copy_critical_parameters(&dec, this);
+#ifdef JPEG_C_PARAM_SUPPORTED
+  // mozjpeg defaults to a progressive scan script; start out sequential
+  jpeg_c_set_bool_param(
+      this, JBOOLEAN_OPTIMIZE_SCANS, static_cast<boolean>(FALSE));
+  scan_info = nullptr;
+  num_scans = 0;
+#endif
   progressive_mode = static_cast<boolean>(FALSE);
   optimize_coding = static_cast<boolean>(TRUE);
+}
+
+Compress::Compress(Decompress& dec) : jpeg_compress_struct{}
+{
+  Defaults(dec);
+}
+
+Compress::Compress(Decompress& dec, size_t memhint)
+    : jpeg_compress_struct{},
+      dst_{std::make_unique<ManagedMemoryDestination>(memhint)}
+{
+  Defaults(dec);
   dest = dst_.get();
 }
 
 Compress::Compress(Decompress& dec, uint8_t* buffer, size_t capacity)
     : jpeg_compress_struct{},
       dst_{std::make_unique<UnmanagedMemoryDestination>(buffer, capacity)}
+{
+  Defaults(dec);
+  dest = dst_.get();
+}
+
+Compress::Compress(Decompress& dec, size_t memhint, int quality)
+    : jpeg_compress_struct{},
+      dst_{std::make_unique<ManagedMemoryDestination>(memhint)}
 {
   jpeg_create_compress(this);
 
   err = dec.err;
-  jpeg_copy_critical_parameters(&dec, this);
-  progressive_mode = static_cast<boolean>(FALSE);
+  image_width = dec.output_width;
+  image_height = dec.output_height;
+  input_components = dec.output_components;
+  in_color_space = dec.out_color_space;
+  jpeg_set_defaults(this);
+  jpeg_set_colorspace(this, dec.jpeg_color_space);
+  jpeg_set_quality(this, quality, static_cast<boolean>(TRUE));
   optimize_coding = static_cast<boolean>(TRUE);
   dest = dst_.get();
 }
 
+void Compress::OptimalTables(const HuffmanStats& stats)
+{
+  const auto info = reinterpret_cast<j_common_ptr>(this);
+  const auto install = [info](JHUFF_TBL*& ptr, const long* freq) {
+    HuffmanTable tbl;
+    tbl.Optimize(info, freq);
+    if (ptr == nullptr) {
+      ptr = jpeg_alloc_huff_table(info);
+    }
+    memcpy(ptr->bits, tbl.bits, sizeof(ptr->bits));
+    memcpy(ptr->huffval, tbl.vals, sizeof(ptr->huffval));
+    ptr->sent_table = static_cast<boolean>(FALSE);
+  };
+  bool dcdone[NUM_HUFF_TBLS]{};
+  bool acdone[NUM_HUFF_TBLS]{};
+  for (int ci = 0; ci < num_components; ci++) {
+    const auto dc = comp_info[ci].dc_tbl_no;
+    const auto ac = comp_info[ci].ac_tbl_no;
+    if (!dcdone[dc]) {
+      install(dc_huff_tbl_ptrs[dc], stats.dc[dc]);
+      dcdone[dc] = true;
+    }
+    if (!acdone[ac]) {
+      install(ac_huff_tbl_ptrs[ac], stats.ac[ac]);
+      acdone[ac] = true;
+    }
+  }
+  optimize_coding = static_cast<boolean>(FALSE);
+}
+
 void MemoryDestination::init(j_compress_ptr compress)
 {
   const auto dest = reinterpret_cast<Compress*>(compress)->Dest();
@@ -202,111 +669,1765 @@ void ManagedMemoryDestination::Term()
   free_in_buffer = 0;
 }
 
-Optimizer::Optimizer(
-    Local<Promise::Resolver>& res,
-    Local<ArrayBufferView>& buf,
-    MaybeLocal<ArrayBufferView>& outbuf,
-    StripFlags flags)
-    : Nan::AsyncWorker(nullptr, "jpegoptimize"),
-      buffer_{BufferData(buf)},
-      len_{buf->ByteLength()},
-#ifdef HAS_EXIF
-      stripThumb_{(flags & StripThumbnail) == StripThumbnail},
-#endif
-      stripMeta_{(flags & StripMeta) == StripMeta},
-      stripICC_{(flags & StripICC) == StripICC}
+Requantizer::Requantizer(Decompress& dec, int maxQuality)
 {
-  SaveToPersistent("buf", buf);
-  SaveToPersistent("res", res);
-  if (!outbuf.IsEmpty()) {
-    auto obuf = outbuf.ToLocalChecked();
-    SaveToPersistent("out", obuf);
-    outbuf_ = BufferData(obuf);
-    outlen_ = obuf->ByteLength();
+  if (maxQuality <= 0) {
+    return;
+  }
+  const auto table = [&dec](int ci) {
+    const auto& comp = dec.comp_info[ci];
+    return comp.quant_table != nullptr ? comp.quant_table
+                                       : dec.quant_tbl_ptrs[comp.quant_tbl_no];
+  };
+  for (int ci = 0; ci < dec.num_components; ci++) {
+    if (table(ci) == nullptr) {
+      return;  // libjpeg will complain soon enough
+    }
+  }
+  const auto luma = dec.comp_info[0].quant_tbl_no;
+  const auto chroma = dec.num_components > 1 &&
+          dec.comp_info[1].quant_tbl_no != luma
+      ? table(1)
+      : nullptr;
+  if (EstimateQuality(table(0), chroma) <= maxQuality) {
+    return;
+  }
+
+  // As jpeg_set_quality would, forcing baseline tables
+  const auto scale = static_cast<unsigned int>(
+      maxQuality < 50 ? 5000 / maxQuality : 200 - maxQuality * 2);
+  for (int ci = 0; ci < dec.num_components; ci++) {
+    const auto tbl = table(ci);
+    const auto std = dec.comp_info[ci].quant_tbl_no == luma
+        ? std_luminance_quant_tbl
+        : std_chrominance_quant_tbl;
+    for (int i = 0; i < DCTSIZE2; i++) {
+      const auto target =
+          std::min(std::max((std[i] * scale + 50) / 100, 1u), 255u);
+      from_[ci][i] = tbl->quantval[i];
+      to_[ci][i] = static_cast<uint16_t>(
+          std::max(static_cast<unsigned int>(from_[ci][i]), target));
+      changed_[ci] = changed_[ci] || to_[ci][i] != from_[ci][i];
+    }
+    active_ = active_ || changed_[ci];
   }
 }
 
-bool Optimizer::CopyMarkers(ErrorManager& err, Decompress& dec)
+void Requantizer::Apply(
+    Decompress& dec,
+    jvirt_barray_ptr* coefs,
+    JDIMENSION first,
+    JDIMENSION last) const
 {
-  auto marker = dec.marker_list;
-  auto sawICC{false};
-  std::vector<decltype(marker)> mrks;
-  while (marker != nullptr) {
-    switch (marker->marker) {
-    case JPEG_APP0 + 1:
-      if (stripMeta_) {
-        break;
-      }
-      if (marker->data_length > TAG_EXIF_LEN &&
-          memcmp(marker->data, TAG_EXIF, TAG_EXIF_LEN) == 0) {
-        mrks.push_back(marker);
+  const auto info = reinterpret_cast<j_common_ptr>(&dec);
+  for (int ci = 0; ci < dec.num_components; ci++) {
+    if (!changed_[ci]) {
+      continue;
+    }
+    const auto& comp = dec.comp_info[ci];
+    const auto v = static_cast<JDIMENSION>(comp.v_samp_factor);
+    for (JDIMENSION row = first * v;
+         row < comp.height_in_blocks && row / v < last;
+         row++) {
+      const auto blocks = dec.mem->access_virt_barray(
+          info, coefs[ci], row, 1, static_cast<boolean>(TRUE));
+      for (JDIMENSION col = 0; col < comp.width_in_blocks; col++) {
+        Block(ci, blocks[0][col]);
       }
-      else if (
-          marker->data_length > TAG_XMP_LEN &&
-          memcmp(marker->data, TAG_XMP, TAG_XMP_LEN) == 0) {
-        mrks.push_back(marker);
+    }
+  }
+}
+
+void Requantizer::Install(Decompress& dec) const
+{
+  for (int ci = 0; ci < dec.num_components; ci++) {
+    if (!changed_[ci]) {
+      continue;
+    }
+    // jpeg_copy_critical_parameters insists both agree
+    const auto& comp = dec.comp_info[ci];
+    const auto slot = dec.quant_tbl_ptrs[comp.quant_tbl_no];
+    if (comp.quant_table != nullptr &&
+        memcmp(comp.quant_table->quantval, from_[ci], sizeof(from_[ci])) !=
+            0) {
+      // Redefined after the header; the coefficients are off now
+      ERREXIT1(&dec, JERR_MISMATCHED_QUANT_TABLE, comp.quant_tbl_no);
+    }
+    for (const auto tbl : {slot, comp.quant_table}) {
+      if (tbl != nullptr) {
+        memcpy(tbl->quantval, to_[ci], sizeof(tbl->quantval));
       }
-      break;
+    }
+  }
+}
 
-    case JPEG_APP0 + 2:
-      if (stripICC_) {
-        break;
+CoefficientStream::CoefficientStream(Decompress& dec)
+    : dec_{dec},
+      data_{dec.src->next_input_byte},
+      end_{dec.src->next_input_byte + dec.src->bytes_in_buffer}
+{
+  const auto info = reinterpret_cast<j_common_ptr>(&dec);
+  if (dec.comps_in_scan == 1) {
+    const auto comp = dec.cur_comp_info[0];
+    const auto v = static_cast<JDIMENSION>(comp->v_samp_factor);
+    mcuCols_ = comp->width_in_blocks;
+    mcuRows_ = (comp->height_in_blocks + v - 1) / v;
+    comps_[comp->component_index].width = comp->width_in_blocks;
+  }
+  else {
+    const auto mcuw = static_cast<JDIMENSION>(dec.max_h_samp_factor * DCTSIZE);
+    const auto mcuh = static_cast<JDIMENSION>(dec.max_v_samp_factor * DCTSIZE);
+    mcuCols_ = (dec.image_width + mcuw - 1) / mcuw;
+    mcuRows_ = (dec.image_height + mcuh - 1) / mcuh;
+    for (int ci = 0; ci < dec.num_components; ci++) {
+      comps_[ci].width = mcuCols_ * dec.comp_info[ci].h_samp_factor;
+    }
+  }
+
+  for (int ci = 0; ci < dec.num_components; ci++) {
+    auto& c = comps_[ci];
+    c.height = static_cast<JDIMENSION>(dec.comp_info[ci].v_samp_factor);
+    c.blocks.reset(new JBLOCK[c.width * c.height]);
+    c.rows.resize(c.height);
+    for (JDIMENSION y = 0; y < c.height; y++) {
+      c.rows[y] = c.blocks.get() + y * c.width;
+    }
+    arrays_[ci] = reinterpret_cast<jvirt_barray_ptr>(&c);
+  }
+
+  // jpeg_make_d_derived_tbl
+  const auto derive = [info](DecodeTable& dtbl, const JHUFF_TBL* htbl) {
+    if (dtbl.tbl == htbl) {
+      return;
+    }
+    dtbl.tbl = htbl;
+    unsigned int huffcode[257];
+    int p = 0;
+    unsigned int code = 0;
+    for (int l = 1; l <= 16; l++) {
+      const int n = htbl->bits[l];
+      if (n == 0) {
+        dtbl.maxcode[l] = -1;
+        code <<= 1u;
+        continue;
       }
-      if (sawICC ||
-          (marker->data_length > TAG_ICC_LEN &&
-           memcmp(marker->data, TAG_ICC, TAG_ICC_LEN) == 0)) {
-        sawICC = true;
-        mrks.push_back(marker);
+      if (p + n > 256) {
+        ERREXIT(info, JERR_BAD_HUFF_TABLE);
       }
+      dtbl.valoffset[l] = p - static_cast<long>(code);
+      for (int i = 0; i < n; i++) {
+        huffcode[p++] = code++;
+      }
+      if (code > (1u << static_cast<unsigned int>(l))) {
+        ERREXIT(info, JERR_BAD_HUFF_TABLE);
+      }
+      dtbl.maxcode[l] = static_cast<long>(code) - 1;
+      code <<= 1u;
+    }
+    dtbl.maxcode[17] = 0xfffffL;
+
+    memset(dtbl.lookup, 0, sizeof(dtbl.lookup));
+    p = 0;
+    for (int l = 1; l <= 8; l++) {
+      for (int i = 0; i < htbl->bits[l]; i++, p++) {
+        const auto lookbits = huffcode[p] << static_cast<unsigned int>(8 - l);
+        for (unsigned int ctr = 0; ctr < (1u << (8u - l)); ctr++) {
+          dtbl.lookup[lookbits + ctr] =
+              static_cast<uint16_t>((l << 8) | htbl->huffval[p]);
+        }
+      }
+    }
+  };
+  for (int i = 0; i < dec.comps_in_scan; i++) {
+    const auto comp = dec.cur_comp_info[i];
+    derive(dctbls_[comp->dc_tbl_no], dec.dc_huff_tbl_ptrs[comp->dc_tbl_no]);
+    derive(actbls_[comp->ac_tbl_no], dec.ac_huff_tbl_ptrs[comp->ac_tbl_no]);
+  }
+
+  Rewind();
+}
+
+bool CoefficientStream::Supported(Decompress& dec)
+{
+  if (dec.progressive_mode != 0 || dec.arith_code != 0 ||
+      dec.data_precision != 8 || dec.comps_in_scan != dec.num_components) {
+    return false;
+  }
+  for (int i = 0; i < dec.comps_in_scan; i++) {
+    const auto comp = dec.cur_comp_info[i];
+    if (dec.dc_huff_tbl_ptrs[comp->dc_tbl_no] == nullptr ||
+        dec.ac_huff_tbl_ptrs[comp->ac_tbl_no] == nullptr) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void CoefficientStream::Attach(j_common_ptr info)
+{
+  info->client_data = this;
+  if (access_ == nullptr) {
+    access_ = info->mem->access_virt_barray;
+  }
+  info->mem->access_virt_barray = access;
+}
+
+JBLOCKARRAY CoefficientStream::access(
+    j_common_ptr info,
+    jvirt_barray_ptr ptr,
+    JDIMENSION start,
+    JDIMENSION num,
+    boolean writable)
+{
+  const auto self = reinterpret_cast<CoefficientStream*>(info->client_data);
+  const auto arrays = self->arrays_;
+  const auto end = arrays + self->dec_.num_components;
+  const auto it = std::find(arrays, end, ptr);
+  if (it == end) {
+    return self->access_(info, ptr, start, num, writable);
+  }
+
+  auto& c = self->comps_[it - arrays];
+  const auto row = start / c.height;
+  const auto offset = start - row * c.height;
+  if (writable != 0 || row >= self->mcuRows_ || offset + num > c.height) {
+    ERREXIT(info, JERR_BAD_VIRTUAL_ACCESS);
+  }
+  if (row + 1 != self->row_) {
+    if (row < self->row_) {
+      self->Rewind();
+    }
+    while (self->row_ <= row) {
+      self->DecodeRow();
+    }
+  }
+  return c.rows.data() + offset;
+}
+
+// Like jdhuff.c, zeros get stuffed in once a marker (or the end of the
+// data) is hit.
+void CoefficientStream::Fill()
+{
+  while (bits_ <= 56) {
+    uint64_t c = 0;
+    if (!marker_ && pos_ < end_) {
+      c = *pos_;
+      if (c != 0xff) {
+        pos_++;
+      }
+      else {
+        auto next = pos_ + 1;
+        while (next < end_ && *next == 0xff) {
+          next++;
+        }
+        if (next < end_ && *next == 0) {
+          pos_ = next + 1;
+        }
+        else {
+          marker_ = true;
+          pos_ = next - 1;
+          c = 0;
+        }
+      }
+    }
+    bitbuf_ = (bitbuf_ << 8u) | c;
+    bits_ += 8;
+  }
+}
+
+inline int CoefficientStream::Bits(int n)
+{
+  if (n == 0) {
+    return 0;
+  }
+  if (bits_ < n) {
+    Fill();
+  }
+  bits_ -= n;
+  return static_cast<int>((bitbuf_ >> static_cast<unsigned int>(bits_)) &
+                          ((1u << static_cast<unsigned int>(n)) - 1));
+}
+
+inline int CoefficientStream::Decode(const DecodeTable& tbl)
+{
+  if (bits_ < 16) {
+    Fill();
+  }
+  const auto peek = static_cast<unsigned int>(
+      (bitbuf_ >> static_cast<unsigned int>(bits_ - 8)) & 0xff);
+  const auto look = tbl.lookup[peek];
+  if (look != 0) {
+    bits_ -= look >> 8;
+    return look & 0xff;
+  }
+  for (int l = 9; l <= 16; l++) {
+    const auto code = static_cast<long>(
+        (bitbuf_ >> static_cast<unsigned int>(bits_ - l)) &
+        ((1u << static_cast<unsigned int>(l)) - 1));
+    if (code <= tbl.maxcode[l]) {
+      bits_ -= l;
+      return tbl.tbl->huffval[(code + tbl.valoffset[l]) & 0xff];
+    }
+  }
+  // Corrupt data; libjpeg fakes a zero as well
+  bits_ -= 16;
+  return 0;
+}
+
+void CoefficientStream::Restart()
+{
+  bitbuf_ = 0;
+  bits_ = 0;
+  auto p = pos_;
+  while (p + 1 < end_ && p[0] == 0xff && p[1] == 0xff) {
+    p++;
+  }
+  if (p + 1 < end_ && p[0] == 0xff && p[1] == JPEG_RST0 + nextrst_) {
+    pos_ = p + 2;
+    marker_ = false;
+  }
+  nextrst_ = (nextrst_ + 1) & 7;
+  restarts_ = dec_.restart_interval;
+  memset(lastdc_, 0, sizeof(lastdc_));
+}
+
+void CoefficientStream::Rewind()
+{
+  pos_ = data_;
+  bitbuf_ = 0;
+  bits_ = 0;
+  marker_ = false;
+  memset(lastdc_, 0, sizeof(lastdc_));
+  restarts_ = dec_.restart_interval;
+  nextrst_ = 0;
+  row_ = 0;
+}
+
+void CoefficientStream::DecodeRow()
+{
+  const auto info = reinterpret_cast<j_common_ptr>(&dec_);
+  const auto mcu = [&]() {
+    if (dec_.restart_interval != 0) {
+      if (restarts_ == 0) {
+        Restart();
+      }
+      restarts_--;
+    }
+  };
+  const auto block = [&](JCOEF* coef, int i) {
+    const auto comp = dec_.cur_comp_info[i];
+    const auto& dc = dctbls_[comp->dc_tbl_no];
+    const auto& ac = actbls_[comp->ac_tbl_no];
+    memset(coef, 0, sizeof(JBLOCK));
+    auto s = Decode(dc);
+    if (s > 16) {
+      ERREXIT(info, JERR_BAD_DCT_COEF);
+    }
+    if (s != 0) {
+      const auto r = Bits(s);
+      s = r < (1 << (s - 1)) ? r - (1 << s) + 1 : r;
+    }
+    lastdc_[i] += s;
+    coef[0] = static_cast<JCOEF>(lastdc_[i]);
+    for (int k = 1; k < DCTSIZE2; k++) {
+      s = Decode(ac);
+      auto r = s >> 4;
+      s &= 15;
+      if (s != 0) {
+        k += r;
+        r = Bits(s);
+        s = r < (1 << (s - 1)) ? r - (1 << s) + 1 : r;
+        coef[k < DCTSIZE2 ? natural_order[k] : DCTSIZE2 - 1] =
+            static_cast<JCOEF>(s);
+      }
+      else {
+        if (r != 15) {
+          break;
+        }
+        k += 15;
+      }
+    }
+    if (requant_) {
+      requant_->Block(comp->component_index, coef);
+    }
+  };
+
+  if (dec_.comps_in_scan == 1) {
+    const auto comp = dec_.cur_comp_info[0];
+    auto& c = comps_[comp->component_index];
+    const auto rows =
+        std::min(c.height, comp->height_in_blocks - row_ * c.height);
+    for (JDIMENSION y = 0; y < rows; y++) {
+      for (JDIMENSION x = 0; x < mcuCols_; x++) {
+        mcu();
+        block(c.rows[y][x], 0);
+      }
+    }
+    row_++;
+    return;
+  }
+
+  for (JDIMENSION col = 0; col < mcuCols_; col++) {
+    mcu();
+    for (int i = 0; i < dec_.comps_in_scan; i++) {
+      const auto comp = dec_.cur_comp_info[i];
+      auto& c = comps_[comp->component_index];
+      const auto h = static_cast<JDIMENSION>(comp->h_samp_factor);
+      for (JDIMENSION y = 0; y < c.height; y++) {
+        for (JDIMENSION x = 0; x < h; x++) {
+          block(c.rows[y][col * h + x], i);
+        }
+      }
+    }
+  }
+  row_++;
+}
+
+void HuffmanTable::Optimize(j_common_ptr info, const long* freq)
+{
+  // Straight from jpeg_gen_optimal_table, so that the tables (and thus
+  // the sizes) come out the same.
+  constexpr const int MAX_CLEN = 32;
+  uint8_t clen[MAX_CLEN + 1]{};
+  int codesize[257]{};
+  int others[257];
+  long f[257];
+  for (int i = 0; i < 257; i++) {
+    others[i] = -1;
+    f[i] = freq[i];
+  }
+  f[256] = 1;  // reserved, so no code is all 1-bits
+
+  for (;;) {
+    int c1 = -1;
+    long v = 1000000000L;
+    for (int i = 0; i <= 256; i++) {
+      if (f[i] != 0 && f[i] <= v) {
+        v = f[i];
+        c1 = i;
+      }
+    }
+    int c2 = -1;
+    v = 1000000000L;
+    for (int i = 0; i <= 256; i++) {
+      if (f[i] != 0 && f[i] <= v && i != c1) {
+        v = f[i];
+        c2 = i;
+      }
+    }
+    if (c2 < 0) {
+      break;
+    }
+    f[c1] += f[c2];
+    f[c2] = 0;
+    codesize[c1]++;
+    while (others[c1] >= 0) {
+      c1 = others[c1];
+      codesize[c1]++;
+    }
+    others[c1] = c2;
+    codesize[c2]++;
+    while (others[c2] >= 0) {
+      c2 = others[c2];
+      codesize[c2]++;
+    }
+  }
+
+  for (int i = 0; i <= 256; i++) {
+    if (codesize[i] != 0) {
+      if (codesize[i] > MAX_CLEN) {
+        ERREXIT(info, JERR_HUFF_CLEN_OVERFLOW);
+      }
+      clen[codesize[i]]++;
+    }
+  }
+  int i = MAX_CLEN;
+  for (; i > 16; i--) {
+    while (clen[i] > 0) {
+      int j = i - 2;
+      while (clen[j] == 0) {
+        j--;
+      }
+      clen[i] -= 2;
+      clen[i - 1]++;
+      clen[j + 1] += 2;
+      clen[j]--;
+    }
+  }
+  while (clen[i] == 0) {
+    i--;
+  }
+  clen[i]--;  // the reserved code
+  memcpy(bits, clen, sizeof(bits));
+
+  int p = 0;
+  for (i = 1; i <= MAX_CLEN; i++) {
+    for (int j = 0; j <= 255; j++) {
+      if (codesize[j] == i) {
+        vals[p++] = static_cast<uint8_t>(j);
+      }
+    }
+  }
+
+  // jpeg_make_c_derived_tbl
+  memset(codes, 0, sizeof(codes));
+  memset(sizes, 0, sizeof(sizes));
+  unsigned int code = 0;
+  p = 0;
+  for (int l = 1; l <= 16; l++) {
+    for (int n = 0; n < bits[l]; n++, p++) {
+      codes[vals[p]] = code++;
+      sizes[vals[p]] = static_cast<uint8_t>(l);
+    }
+    code <<= 1u;
+  }
+}
+
+void HuffmanStats::Gather(
+    Compress& comp, Decompress& dec, jvirt_barray_ptr* coefs)
+{
+  const auto info = reinterpret_cast<j_common_ptr>(&dec);
+  int lastdc[MAX_COMPONENTS]{};
+  StatsSink sink;
+  ForEachBlock(dec, coefs, [&](int ci, const JCOEF* block) {
+    sink.dcfreq = dc[comp.comp_info[ci].dc_tbl_no];
+    sink.acfreq = ac[comp.comp_info[ci].ac_tbl_no];
+    CodeBlock(info, block, lastdc[ci], sink);
+  });
+}
+
+void HuffmanStats::Gather(
+    Compress& comp, const std::vector<ComponentStats>& comps)
+{
+  for (size_t ci = 0; ci < comps.size(); ci++) {
+    const auto dcfreq = dc[comp.comp_info[ci].dc_tbl_no];
+    const auto acfreq = ac[comp.comp_info[ci].ac_tbl_no];
+    for (int i = 0; i < 257; i++) {
+      dcfreq[i] += comps[ci].dc[i];
+      acfreq[i] += comps[ci].ac[i];
+    }
+  }
+}
+
+StatsCollector::StatsCollector(Decompress& dec)
+    : dec_{dec}, comps_(dec.num_components)
+{
+}
+
+bool StatsCollector::Supported(Decompress& dec)
+{
+  return dec.progressive_mode == 0 && dec.data_precision == 8 &&
+      dec.comps_in_scan == dec.num_components;
+}
+
+void StatsCollector::Attach()
+{
+  const auto info = reinterpret_cast<j_common_ptr>(&dec_);
+  info->client_data = this;
+  access_ = info->mem->access_virt_barray;
+  info->mem->access_virt_barray = access;
+}
+
+void StatsCollector::Finish(jvirt_barray_ptr* coefs)
+{
+  const auto info = reinterpret_cast<j_common_ptr>(&dec_);
+  info->mem->access_virt_barray = access_;
+  info->client_data = nullptr;
+  if (!std::equal(coefs, coefs + dec_.num_components, arrays_)) {
+    // Not what we watched, so start over
+    comps_.assign(dec_.num_components, ComponentStats());
+    std::fill(std::begin(lastdc_), std::end(lastdc_), 0);
+    row_ = 0;
+  }
+  Count(coefs, dec_.total_iMCU_rows);
+}
+
+JBLOCKARRAY StatsCollector::access(
+    j_common_ptr info,
+    jvirt_barray_ptr ptr,
+    JDIMENSION start,
+    JDIMENSION num,
+    boolean writable)
+{
+  const auto self = reinterpret_cast<StatsCollector*>(info->client_data);
+  const auto& dec = self->dec_;
+  if (writable != 0) {
+    // jdcoefct.c requests the arrays of the scan's components in turn, an
+    // iMCU row at a time
+    const auto first = dec.cur_comp_info[0];
+    if (self->seen_ < dec.comps_in_scan) {
+      const auto comp = dec.cur_comp_info[self->seen_++];
+      self->arrays_[comp->component_index] = ptr;
+    }
+    else if (ptr == self->arrays_[first->component_index]) {
+      const auto v = static_cast<JDIMENSION>(first->v_samp_factor);
+      self->Count(self->arrays_, start / v);
+    }
+  }
+  return self->access_(info, ptr, start, num, writable);
+}
+
+void StatsCollector::Count(jvirt_barray_ptr* coefs, JDIMENSION rows)
+{
+  if (rows <= row_) {
+    return;
+  }
+  const auto first = row_;
+  row_ = rows;  // before requantizing accesses the arrays again
+  if (requant_) {
+    requant_->Apply(dec_, coefs, first, rows);
+  }
+  const auto info = reinterpret_cast<j_common_ptr>(&dec_);
+  StatsSink sink;
+  ForEachBlock(
+      dec_,
+      coefs,
+      [&](int ci, const JCOEF* block) {
+        sink.dcfreq = comps_[ci].dc;
+        sink.acfreq = comps_[ci].ac;
+        CodeBlock(info, block, lastdc_[ci], sink);
+      },
+      first,
+      rows);
+}
+
+size_t EstimateSize(
+    Compress& comp,
+    Decompress& dec,
+    jvirt_barray_ptr* coefs,
+    const HuffmanStats& stats,
+    size_t markerBytes)
+{
+  const auto info = reinterpret_cast<j_common_ptr>(&dec);
+
+  // Mirror what jcmarker.c writes
+  size_t rv = 2;  // SOI
+  if (comp.write_JFIF_header != 0) {
+    rv += 18;
+  }
+  if (comp.write_Adobe_marker != 0) {
+    rv += 16;
+  }
+  rv += markerBytes;
+
+  bool qused[NUM_QUANT_TBLS]{};
+  for (int ci = 0; ci < comp.num_components; ci++) {
+    const auto q = comp.comp_info[ci].quant_tbl_no;
+    if (qused[q]) {
+      continue;
+    }
+    qused[q] = true;
+    const auto tbl = comp.quant_tbl_ptrs[q];
+    const auto prec = std::any_of(
+        tbl->quantval, tbl->quantval + DCTSIZE2,
+        [](UINT16 v) { return v > 255; });
+    rv += prec ? 133 : 69;  // DQT
+  }
+  rv += 10 + 3 * comp.num_components;  // SOF
+
+  HuffmanTable dctbls[NUM_HUFF_TBLS];
+  HuffmanTable actbls[NUM_HUFF_TBLS];
+  bool dcused[NUM_HUFF_TBLS]{};
+  bool acused[NUM_HUFF_TBLS]{};
+  const auto dht = [&](HuffmanTable& tbl, bool& used, const long* freq) {
+    if (used) {
+      return;
+    }
+    used = true;
+    tbl.Optimize(info, freq);
+    rv += 21;
+    for (int l = 1; l <= 16; l++) {
+      rv += tbl.bits[l];
+    }
+  };
+  for (int ci = 0; ci < comp.num_components; ci++) {
+    const auto dc = comp.comp_info[ci].dc_tbl_no;
+    const auto ac = comp.comp_info[ci].ac_tbl_no;
+    dht(dctbls[dc], dcused[dc], stats.dc[dc]);
+    dht(actbls[ac], acused[ac], stats.ac[ac]);
+  }
+  rv += 8 + 2 * comp.num_components;  // SOS
+
+  int lastdc[MAX_COMPONENTS]{};
+  BitCounter counter;
+  ForEachBlock(dec, coefs, [&](int ci, const JCOEF* block) {
+    const auto& c = comp.comp_info[ci];
+    counter.Select(&dctbls[c.dc_tbl_no], &actbls[c.ac_tbl_no]);
+    CodeBlock(info, block, lastdc[ci], counter);
+  });
+  rv += counter.Flush();
+
+  return rv + 2;  // EOI
+}
+
+bool IsNeutralChroma(Decompress& dec, jvirt_barray_ptr* coefs)
+{
+  if (dec.jpeg_color_space != JCS_YCbCr || dec.num_components != 3) {
+    return false;
+  }
+  const auto& luma = dec.comp_info[0];
+  if (luma.h_samp_factor != dec.max_h_samp_factor ||
+      luma.v_samp_factor != dec.max_v_samp_factor) {
+    return false;
+  }
+
+  // Walk iMCU rows in order, so that a CoefficientStream decodes only once
+  const auto info = reinterpret_cast<j_common_ptr>(&dec);
+  const auto mcuh = static_cast<JDIMENSION>(dec.max_v_samp_factor * DCTSIZE);
+  const auto rows = (dec.image_height + mcuh - 1) / mcuh;
+  for (JDIMENSION row = 0; row < rows; ++row) {
+    for (int ci = 1; ci < dec.num_components; ++ci) {
+      const auto& comp = dec.comp_info[ci];
+      const auto v = static_cast<JDIMENSION>(comp.v_samp_factor);
+      const auto blocks = dec.mem->access_virt_barray(
+          info, coefs[ci], row * v, v, static_cast<boolean>(FALSE));
+      for (JDIMENSION y = 0; y < v && row * v + y < comp.height_in_blocks;
+           ++y) {
+        for (JDIMENSION col = 0; col < comp.width_in_blocks; ++col) {
+          const auto block = blocks[y][col];
+          for (int k = 0; k < DCTSIZE2; ++k) {
+            if (block[k] != 0) {
+              return false;
+            }
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+bool MPFIndex::Read(const uint8_t* data, const size_t len)
+{
+  entries.clear();
+  directory = false;
+  if (len < 4 || data[0] != 0xff || data[1] != M_SOI) {
+    return false;
+  }
+
+  size_t mpf = 0;
+  size_t mpflen = 0;
+  size_t pos = 2;
+  while (pos + 4 <= len && data[pos] == 0xff) {
+    const auto m = data[pos + 1];
+    if (m == 0xff) {
+      ++pos;
+      continue;
+    }
+    if (m == M_SOS || m == JPEG_EOI) {
+      break;
+    }
+    const auto seglen =
+        (static_cast<size_t>(data[pos + 2]) << 8u) | data[pos + 3];
+    if (seglen < 2 || pos + 2 + seglen > len) {
+      break;
+    }
+    const auto seg = data + pos + 4;
+    const auto n = seglen - 2;
+    if (m == JPEG_APP0 + 2 && mpf == 0 && n > TAG_MPF_LEN &&
+        memcmp(seg, TAG_MPF, TAG_MPF_LEN) == 0) {
+      mpf = pos + 4 + TAG_MPF_LEN;
+      mpflen = n - TAG_MPF_LEN;
+    }
+    else if (
+        m == JPEG_APP0 + 1 && n > TAG_XMP_LEN &&
+        memcmp(seg, TAG_XMP, TAG_XMP_LEN) == 0 &&
+        std::search(
+            seg, seg + n, TAG_ITEM_LENGTH,
+            TAG_ITEM_LENGTH + TAG_ITEM_LENGTH_LEN) != seg + n) {
+      directory = true;
+    }
+    pos += 2 + seglen;
+  }
+  if (mpf == 0 || mpflen < 8) {
+    return false;
+  }
+
+  const auto tiff = data + mpf;
+  if (memcmp(tiff, "II*\0", 4) == 0) {
+    little = true;
+  }
+  else if (memcmp(tiff, "MM\0*", 4) == 0) {
+    little = false;
+  }
+  else {
+    return false;
+  }
+  const auto u16 = [&](size_t off) -> uint32_t {
+    return little ? tiff[off] | (tiff[off + 1] << 8u)
+                  : (tiff[off] << 8u) | tiff[off + 1];
+  };
+  const auto u32 = [&](size_t off) -> uint32_t {
+    return little ? u16(off) | (u16(off + 2) << 16u)
+                  : (u16(off) << 16u) | u16(off + 2);
+  };
+
+  const size_t ifd = u32(4);
+  if (ifd + 2 > mpflen) {
+    return false;
+  }
+  const size_t count = u16(ifd);
+  if (ifd + 2 + count * 12 > mpflen) {
+    return false;
+  }
+  size_t table = 0;
+  size_t tablelen = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const auto e = ifd + 2 + i * 12;
+    if (u16(e) == MPF_ENTRY && u16(e + 2) == TIFF_UNDEFINED) {
+      tablelen = u32(e + 4);
+      table = u32(e + 8);
+    }
+  }
+  if (tablelen == 0 || tablelen % 16 != 0 || table > mpflen ||
+      tablelen > mpflen - table) {
+    return false;
+  }
+
+  base = mpf;
+  for (auto off = table; off < table + tablelen; off += 16) {
+    entries.push_back(Entry{mpf + off + 4, u32(off + 4), u32(off + 8)});
+  }
+  return true;
+}
+
+bool MPFIndex::Valid(const size_t len) const
+{
+  if (entries.empty() || entries[0].offset != 0 || entries[0].size > len) {
+    return false;
+  }
+  size_t pos = entries[0].size;
+  for (size_t i = 1; i < entries.size(); ++i) {
+    if (!Present(i)) {
+      continue;
+    }
+    const auto start = base + entries[i].offset;
+    if (start < pos || start > len || entries[i].size > len - start) {
+      return false;
+    }
+    pos = start + entries[i].size;
+  }
+  return true;
+}
+
+bool MPFIndex::Write(
+    uint8_t* data,
+    const std::vector<uint32_t>& sizes,
+    const std::vector<uint32_t>& offsets) const
+{
+  const auto put = [&](size_t off, uint32_t v) {
+    for (size_t i = 0; i < 4; ++i) {
+      const auto shift = little ? 8 * i : 8 * (3 - i);
+      data[off + i] = static_cast<uint8_t>(v >> shift);
+    }
+  };
+
+  if (sizes.size() != offsets.size()) {
+    return false;
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (!Present(i)) {
+      continue;
+    }
+    if (n == sizes.size() || (i != 0 && offsets[n] < base)) {
+      return false;
+    }
+    put(entries[i].field, sizes[n]);
+    put(
+        entries[i].field + 4,
+        i == 0 ? 0 : static_cast<uint32_t>(offsets[n] - base));
+    n++;
+  }
+  return n == sizes.size();
+}
+
+Job::Job(
+    const char* name,
+    Local<Promise::Resolver>& res,
+    Local<ArrayBufferView>& buf,
+    Flags flags)
+    : Nan::AsyncWorker(nullptr, name),
+      buffer_{BufferData(buf)},
+      len_{buf->ByteLength()},
+#ifdef HAS_EXIF
+      stripThumb_{(flags & StripThumbnail) == StripThumbnail},
+#endif
+      stripMeta_{(flags & StripMeta) == StripMeta},
+      stripICC_{(flags & StripICC) == StripICC},
+      lowMemory_{(flags & LowMemory) == LowMemory}
+{
+  SaveToPersistent("buf", buf);
+  SaveToPersistent("res", res);
+}
+
+void Job::PrepareMarkers()
+{
+#ifdef HAS_EXIF
+  if (!stripMeta_ && stripThumb_) {
+    std::unique_ptr<ExifData, ed> exif(exif_data_new_from_data(buffer_, len_));
+    if (exif && exif->data != nullptr && exif->size > 0) {
+      free(exif->data);  // NOLINT
+      exif->data = nullptr;
+      exif->size = 0;
+      exif_data_fix(exif.get());
+
+      unsigned char* data;
+      unsigned int len;
+      exif_data_save_data(exif.get(), &data, &len);
+      std::unique_ptr<char, free_deleter<char>> pdata(
+          reinterpret_cast<char*>(data));
+      if (pdata && len > 0) {
+        replacementExif = std::string(pdata.get(), len);
+      }
+    }
+  }
+#endif
+}
+
+std::vector<Marker> Job::SelectMarkers(Decompress& dec) const
+{
+  auto marker = dec.marker_list;
+  auto sawICC{false};
+  std::vector<decltype(marker)> mrks;
+  while (marker != nullptr) {
+    switch (marker->marker) {
+    case JPEG_APP0 + 1:
+      if (stripMeta_) {
+        break;
+      }
+      if (marker->data_length > TAG_EXIF_LEN &&
+          memcmp(marker->data, TAG_EXIF, TAG_EXIF_LEN) == 0) {
+        mrks.push_back(marker);
+      }
+      else if (
+          marker->data_length > TAG_XMP_LEN &&
+          memcmp(marker->data, TAG_XMP, TAG_XMP_LEN) == 0) {
+        mrks.push_back(marker);
+      }
+      break;
+
+    case JPEG_APP0 + 2:
+      if (marker->data_length > TAG_MPF_LEN &&
+          memcmp(marker->data, TAG_MPF, TAG_MPF_LEN) == 0) {
+        // An index is only any good if the images it indexes are kept,
+        // too; embedded images carry their attributes here
+        if (dec.KeepMPF()) {
+          mrks.push_back(marker);
+        }
+        break;
+      }
+      if (stripICC_) {
+        break;
+      }
+      if (sawICC ||
+          (marker->data_length > TAG_ICC_LEN &&
+           memcmp(marker->data, TAG_ICC, TAG_ICC_LEN) == 0)) {
+        sawICC = true;
+        mrks.push_back(marker);
+      }
+      break;
+
+    case JPEG_APP0 + 13:
+      if (stripMeta_) {
+        break;
+      }
+      if (marker->data_length > TAG_IPTC_LEN &&
+          memcmp(marker->data, TAG_IPTC, TAG_IPTC_LEN) == 0) {
+        mrks.push_back(marker);
+      }
+      break;
+
+    default:
+      // no copy mr roboto
+      break;
+    }
+    marker = marker->next;
+  }
+
+  std::sort(
+      mrks.begin(), mrks.end(), [](decltype(marker) a, decltype(marker) b) {
+        return a->marker < b->marker;
+      });
+
+  std::vector<Marker> rv;
+  rv.reserve(mrks.size());
+#ifdef HAS_EXIF
+  auto replaced{replacementExif.empty()};
+#endif
+  for (const auto& m : mrks) {
+#ifdef HAS_EXIF
+    if (m->marker == JPEG_APP0 + 1 && !replaced) {
+      rv.push_back(Marker{
+          m->marker, reinterpret_cast<const uint8_t*>(replacementExif.data()),
+          static_cast<unsigned int>(replacementExif.size())});
+      replaced = true;
+      continue;
+    }
+#endif
+    rv.push_back(Marker{m->marker, m->data, m->data_length});
+  }
+  return rv;
+}
+
+jvirt_barray_ptr* Job::ReadCoefficients(
+    Decompress& dec,
+    bool collect,
+    const Requantizer* requant)
+{
+  if (lowMemory_ && CoefficientStream::Supported(dec)) {
+    stream_ = std::make_unique<CoefficientStream>(dec);
+    if (requant != nullptr) {
+      stream_->Requantize(*requant);
+    }
+    stream_->Attach(reinterpret_cast<j_common_ptr>(&dec));
+    dec.SkipFinish();
+    return stream_->Arrays();
+  }
+  if (!collect || !StatsCollector::Supported(dec)) {
+    const auto rv = jpeg_read_coefficients(&dec);
+    if (rv != nullptr && requant != nullptr) {
+      requant->Apply(dec, rv);
+    }
+    return rv;
+  }
+  collector_ = std::make_unique<StatsCollector>(dec);
+  if (requant != nullptr) {
+    collector_->Requantize(*requant);
+  }
+  collector_->Attach();
+  const auto rv = jpeg_read_coefficients(&dec);
+  if (rv == nullptr) {
+    collector_.reset();
+    return nullptr;
+  }
+  collector_->Finish(rv);
+  return rv;
+}
+
+void Job::HandleErrorCallback()
+{
+  Nan::HandleScope scope;
+  GetFromPersistent("buf");
+
+  auto resolver = GetFromPersistent("res").As<Promise::Resolver>();
+  auto err = Nan::Error(ErrorMessage()).As<Object>();
+  Nan::DefineOwnProperty(
+      err, Nan::New("invalid").ToLocalChecked(), Nan::New(invalid_));
+  resolver->Reject(Nan::GetCurrentContext(), err).IsNothing();
+}
+
+Optimizer::Optimizer(
+    Local<Promise::Resolver>& res,
+    Local<ArrayBufferView>& buf,
+    MaybeLocal<ArrayBufferView>& outbuf,
+    Flags flags,
+    int previewQuality,
+    int maxQuality)
+    : Job("jpegoptimize", res, buf, flags),
+      effort_{static_cast<Effort>((flags & EffortMask) >> EffortShift)},
+      previewScale_{(flags & PreviewMask) >> PreviewShift},
+      previewQuality_{previewQuality},
+      maxQuality_{maxQuality},
+      skipOptimal_{(flags & SkipOptimal) == SkipOptimal},
+      collapseGray_{(flags & Grayscale) == Grayscale},
+      container_{(flags & Container) == Container},
+      keepMPF_{container_ || (flags & KeepMPF) == KeepMPF},
+      metadataOnly_{(flags & MetadataOnly) == MetadataOnly}
+{
+  if (!outbuf.IsEmpty()) {
+    auto obuf = outbuf.ToLocalChecked();
+    SaveToPersistent("out", obuf);
+    outbuf_ = BufferData(obuf);
+    outlen_ = obuf->ByteLength();
+  }
+}
+
+bool Optimizer::CopyMarkers(ErrorManager& err, Compress& comp, Decompress& dec)
+{
+  for (const auto& m : SelectMarkers(dec)) {
+    jpeg_write_marker(&comp, m.code, m.data, m.length);
+    if (err) {
+      SetErrorMessage(err.msg());
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Predict the output size and decide whether writing it out is futile.
+// Returns true if the job is done (one way or another) already.
+bool Optimizer::Skip(Decompress& dec, jvirt_barray_ptr* coefs)
+{
+  Compress comp(dec);
+  if (!stats_) {
+    stats_ = std::make_unique<HuffmanStats>();
+    stats_->Gather(comp, dec, coefs);
+  }
+  const auto markers = MarkerBytes(SelectMarkers(dec));
+  if (EstimateSize(comp, dec, coefs, *stats_, markers) < InputLength()) {
+    return false;
+  }
+
+  KeepInput();
+  return true;
+}
+
+void Optimizer::KeepInput()
+{
+  compress_.reset();
+  skipped_ = true;
+  if (outbuf_ == nullptr) {
+    return;
+  }
+  const auto len = InputLength();
+  if (outlen_ < len) {
+    SetErrorMessage("Buffer too small");
+    return;
+  }
+  memcpy(outbuf_, buffer_, len);
+  outlen_ = len;
+  copied_ = true;
+}
+
+// Would writing the coefficients again yield the very same entropy coded
+// data? That is the case for a single sequential scan without restarts, whose
+// huffman tables are exactly the ones optimize_coding would make.
+bool Optimizer::TablesOptimal(Decompress& dec)
+{
+  if (!stats_ || dec.progressive_mode != 0 || dec.arith_code != 0 ||
+      dec.restart_interval != 0) {
+    return false;
+  }
+  const auto info = reinterpret_cast<j_common_ptr>(&dec);
+  const auto same = [info](const JHUFF_TBL* tbl, const long* freq) {
+    if (tbl == nullptr) {
+      return false;
+    }
+    HuffmanTable optimal;
+    optimal.Optimize(info, freq);
+    int count = 0;
+    for (int l = 1; l <= 16; l++) {
+      if (tbl->bits[l] != optimal.bits[l]) {
+        return false;
+      }
+      count += tbl->bits[l];
+    }
+    return memcmp(tbl->huffval, optimal.vals, count) == 0;
+  };
+
+  Compress comp(dec);
+  for (int ci = 0; ci < dec.num_components; ci++) {
+    const auto& in = dec.comp_info[ci];
+    const auto& out = comp.comp_info[ci];
+    if (!same(dec.dc_huff_tbl_ptrs[in.dc_tbl_no], stats_->dc[out.dc_tbl_no]) ||
+        !same(dec.ac_huff_tbl_ptrs[in.ac_tbl_no], stats_->ac[out.ac_tbl_no])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Copy the input as is, except for its APPn and COM markers: JFIF and Adobe
+// markers stay (libjpeg would write its own), the others give way to the
+// ones CopyMarkers would write. Tables, frame and scans, entropy coded data
+// included, are not touched.
+// Returns false if the input is not laid out plainly enough for that, or
+// true if the job is done (one way or another) already.
+bool Optimizer::Splice(Decompress& dec)
+{
+  using Segment = std::pair<size_t, size_t>;  // offset, length
+  std::vector<Segment> head;
+  std::vector<Segment> tables;
+  size_t pos = 2;  // SOI
+  for (;;) {
+    while (pos + 1 < len_ && buffer_[pos] == 0xff &&
+           buffer_[pos + 1] == 0xff) {
+      ++pos;  // fill bytes
+    }
+    if (pos + 4 > len_ || buffer_[pos] != 0xff) {
+      return false;
+    }
+    const int code = buffer_[pos + 1];
+    const auto length =
+        2 + ((static_cast<size_t>(buffer_[pos + 2]) << 8u) | buffer_[pos + 3]);
+    if (length < 4 || pos + length > len_) {
+      return false;
+    }
+    if (code == M_SOS) {
+      break;
+    }
+    const auto data = buffer_ + pos + 4;
+    const auto size = length - 4;
+    if (code == JPEG_APP0) {
+      if (size >= TAG_JFIF_LEN && memcmp(data, TAG_JFIF, TAG_JFIF_LEN) == 0) {
+        head.emplace_back(pos, length);
+      }
+    }
+    else if (code == JPEG_APP0 + 14) {
+      if (size >= TAG_ADOBE_LEN &&
+          memcmp(data, TAG_ADOBE, TAG_ADOBE_LEN) == 0) {
+        head.emplace_back(pos, length);
+      }
+    }
+    else if ((code < JPEG_APP0 || code > JPEG_APP0 + 15) && code != JPEG_COM) {
+      tables.emplace_back(pos, length);
+    }
+    pos += length;
+  }
+  const auto sos = pos;
+  const auto scan = sos + 2 +
+      ((static_cast<size_t>(buffer_[sos + 2]) << 8u) | buffer_[sos + 3]);
+  const auto end = ImageEnd(buffer_, len_, scan);
+  end_ = end;
+
+  const auto markers = SelectMarkers(dec);
+  auto size = 2 + MarkerBytes(markers) + (end - sos);
+  for (const auto& segment : head) {
+    size += segment.second;
+  }
+  for (const auto& segment : tables) {
+    size += segment.second;
+  }
+  if (skipOptimal_ && size >= InputLength()) {
+    KeepInput();
+    return true;
+  }
+
+  uint8_t* out;
+  if (outbuf_ != nullptr) {
+    if (size > outlen_) {
+      SetErrorMessage("Buffer too small");
+      return true;
+    }
+    out = outbuf_;
+    outlen_ = size;
+    copied_ = true;
+  }
+  else {
+    spliced_ = std::make_unique<std::vector<uint8_t>>(size);
+    out = spliced_->data();
+  }
+  const auto copy = [&out](const uint8_t* data, size_t length) {
+    memcpy(out, data, length);
+    out += length;
+  };
+  *out++ = 0xff;
+  *out++ = M_SOI;
+  for (const auto& segment : head) {
+    copy(buffer_ + segment.first, segment.second);
+  }
+  for (const auto& m : markers) {
+    const uint8_t header[] = {
+        0xff, static_cast<uint8_t>(m.code),
+        static_cast<uint8_t>((m.length + 2) >> 8u),
+        static_cast<uint8_t>((m.length + 2) & 0xffu)};
+    copy(header, sizeof(header));
+    copy(m.data, m.length);
+  }
+  for (const auto& segment : tables) {
+    copy(buffer_ + segment.first, segment.second);
+  }
+  copy(buffer_ + sos, end - sos);
+  return true;
+}
+
+// Decode at reduced size using the scaled IDCTs, and encode that again.
+// Samples stay in the color space of the image, so there is no color
+// conversion either way.
+bool Optimizer::Preview(ErrorManager& err)
+{
+  Decompress dec(&err, true, stripICC_);
+  dec.init(buffer_, len_);
+  dec.scale_num = 1;
+  dec.scale_denom = 1u << previewScale_;
+  dec.out_color_space = dec.jpeg_color_space;
+  dec.do_fancy_upsampling = static_cast<boolean>(FALSE);
+  jpeg_start_decompress(&dec);
+  if (err) {
+    SetErrorMessage(err.msg());
+    return false;
+  }
+
+  const auto area = dec.scale_denom * dec.scale_denom;
+  preview_ = std::make_unique<Compress>(dec, len_ / area, previewQuality_);
+  preview_->Start();
+  // Only ICC markers were saved
+  if (!CopyMarkers(err, *preview_, dec)) {
+    return false;
+  }
+
+  const auto stride = dec.output_width * dec.output_components;
+  const auto height = static_cast<size_t>(dec.rec_outbuf_height);
+  std::vector<JSAMPLE> samples(stride * height);
+  std::vector<JSAMPROW> rows(height);
+  for (size_t i = 0; i < height; i++) {
+    rows[i] = samples.data() + i * stride;
+  }
+  while (dec.output_scanline < dec.output_height) {
+    const auto read = jpeg_read_scanlines(&dec, rows.data(), height);
+    jpeg_write_scanlines(preview_.get(), rows.data(), read);
+  }
+  preview_->Finish();
+  if (err) {
+    SetErrorMessage(err.msg());
+    return false;
+  }
+  return true;
+}
+
+// Write out the coefficients, either directly to the output buffer (if any,
+// and so requested), or to a new one
+std::unique_ptr<Compress> Optimizer::Encode(
+    ErrorManager& err,
+    Decompress& dec,
+    jvirt_barray_ptr* coefs,
+    bool progressive,
+    bool direct)
+{
+  std::unique_ptr<Compress> rv;
+  if (direct && outbuf_ != nullptr) {
+    rv = std::make_unique<Compress>(dec, outbuf_, outlen_);
+  }
+  else {
+    rv = std::make_unique<Compress>(dec, len_);
+  }
+  if (collapsed_) {
+    rv->Grayscale();
+  }
+  if (progressive) {
+    rv->Progressive();
+  }
+  else if (stats_) {
+    rv->OptimalTables(*stats_);
+  }
+  if (stream_) {
+    stream_->Attach(reinterpret_cast<j_common_ptr>(rv.get()));
+  }
+  rv->Init(coefs);
+  if (err) {
+    SetErrorMessage(err.msg());
+    return nullptr;
+  }
+
+  if (!CopyMarkers(err, *rv, dec)) {
+    return nullptr;
+  }
+
+  rv->Finish();
+  if (err) {
+    SetErrorMessage(err.msg());
+    return nullptr;
+  }
+  return rv;
+}
+
+void Optimizer::Execute()
+{
+  ErrorManager err;
+  if (setjmp(err.setjmp_buffer)) {  // NOLINT
+    invalid_ = err.invalid();
+    if (err) {
+      return SetErrorMessage(err.msg());
+    }
+    return SetErrorMessage("Invalid Image");
+  }
+
+  PrepareMarkers();
+
+  Decompress dec(&err, stripMeta_, stripICC_, keepMPF_);
+  dec.init(buffer_, len_);
+  // Decided on the tables known by now already, so that requantizing can
+  // happen while decoding
+  const Requantizer requant(dec, maxQuality_);
+  if (metadataOnly_ && !requant && Splice(dec)) {
+    dec.SkipFinish();
+    if (previewScale_ != 0) {
+      Preview(err);
+    }
+    return;
+  }
+
+  const auto coefs = ReadCoefficients(
+      dec, effort_ != EffortProgressive, requant ? &requant : nullptr);
+  if (err) {
+    return SetErrorMessage(err.msg());
+  }
+  if (coefs == nullptr) {
+    return SetErrorMessage("Invalid image");
+  }
+  if (requant) {
+    requant.Install(dec);
+  }
+
+  // libjpeg stops right after EOI, unless coefficients are streamed
+  auto pos = len_;
+  const auto next = dec.src->next_input_byte;
+  if (next >= buffer_ && next <= buffer_ + len_) {
+    pos = next - buffer_;
+  }
+  end_ = ImageEnd(buffer_, len_, pos);
+
+  if (previewScale_ != 0 && !Preview(err)) {
+    return;
+  }
+
+  collapsed_ = collapseGray_ && IsNeutralChroma(dec, coefs);
+  if (collector_ && !collapsed_) {
+    Compress comp(dec);
+    stats_ = std::make_unique<HuffmanStats>();
+    stats_->Gather(comp, collector_->Components());
+  }
+  else if (stream_ && !collapsed_ && effort_ != EffortProgressive) {
+    // A pass of its own, but one optimize_coding would make otherwise, and
+    // the output then comes out the same as without streaming
+    Compress comp(dec);
+    stats_ = std::make_unique<HuffmanStats>();
+    stats_->Gather(comp, dec, coefs);
+  }
+
+  // Writing it again would not change a thing, unless requantized
+  if (!requant && effort_ == EffortFast && TablesOptimal(dec) &&
+      Splice(dec)) {
+    return;
+  }
+
+  // The estimate is only any good for sequential output, with all components
+  if (skipOptimal_ && effort_ == EffortFast && !collapsed_ &&
+      Skip(dec, coefs)) {
+    return;
+  }
+
+  compress_ = Encode(
+      err, dec, coefs, effort_ != EffortFast, effort_ != EffortMax);
+  if (!compress_) {
+    return;
+  }
+  if (effort_ == EffortMax) {
+    auto sequential = Encode(err, dec, coefs, false, false);
+    if (!sequential) {
+      compress_.reset();
+      return;
+    }
+    if (sequential->Dest()->Length() <= compress_->Dest()->Length()) {
+      compress_ = std::move(sequential);
+    }
+  }
+
+  const auto dest = compress_->Dest();
+  if (skipOptimal_ && dest->Length() >= InputLength()) {
+    KeepInput();
+    return;
+  }
+  if (outbuf_ != nullptr && dest->Managed()) {
+    // Candidates were written to new buffers; copy the winner
+    if (dest->Length() > outlen_) {
+      compress_.reset();
+      SetErrorMessage("Buffer too small");
+      return;
+    }
+    memcpy(outbuf_, dest->Data(), dest->Length());
+    outlen_ = dest->Length();
+    copied_ = true;
+    compress_.reset();
+  }
+}
+
+void Optimizer::HandleOKCallback()
+{
+  Nan::HandleScope scope;
+  GetFromPersistent("buf");
+  GetFromPersistent("out");
+  auto resolver = GetFromPersistent("res").As<Promise::Resolver>();
+  Local<Value> result;
+  if (copied_) {
+    result = Nan::New<Number>(outlen_);
+  }
+  else if (skipped_) {
+    // Already optimal; hand back the input, without anything trailing it
+    auto input = GetFromPersistent("buf").As<ArrayBufferView>();
+    if (InputLength() < input->ByteLength()) {
+      auto buf = node::Buffer::New(
+          Isolate::GetCurrent(), input->Buffer(), input->ByteOffset(),
+          InputLength());
+      if (buf.IsEmpty()) {
+        auto err = Nan::Error("Cannot create output buffer");
+        resolver->Reject(Nan::GetCurrentContext(), err).IsNothing();
+        return;
+      }
+      result = buf.ToLocalChecked();
+    }
+    else {
+      result = input;
+    }
+  }
+  else if (spliced_) {
+    auto buf = ToBuffer(std::move(spliced_));
+    if (buf.IsEmpty()) {
+      auto err = Nan::Error("Cannot create output buffer");
+      resolver->Reject(Nan::GetCurrentContext(), err).IsNothing();
+      return;
+    }
+    result = buf.ToLocalChecked();
+  }
+  else if (!compress_) {
+    auto err = Nan::Error("Unknown error");
+    resolver->Reject(Nan::GetCurrentContext(), err).IsNothing();
+    return;
+  }
+  else {
+    auto dest = compress_->Buffer();
+    compress_.reset();
+    if (!dest->Managed()) {
+      result = Nan::New<Number>(dest->Length());
+    }
+    else {
+      auto buf = ToBuffer(std::move(dest));
+      if (buf.IsEmpty()) {
+        auto err = Nan::Error("Cannot create output buffer");
+        resolver->Reject(Nan::GetCurrentContext(), err).IsNothing();
+        return;
+      }
+      result = buf.ToLocalChecked();
+    }
+  }
+
+  if (collapseGray_ || container_ || preview_) {
+    auto rv = Nan::New<Object>();
+    Nan::Set(rv, Nan::New("image").ToLocalChecked(), result);
+    if (collapseGray_) {
+      Nan::Set(
+          rv,
+          Nan::New("grayscale").ToLocalChecked(),
+          Nan::New(collapsed_ && !skipped_));
+    }
+    if (container_) {
+      // Where the image ends in the input; anything after it is trailing
+      Nan::Set(
+          rv, Nan::New("length").ToLocalChecked(), Nan::New<Number>(end_));
+    }
+    result = rv;
+  }
+  if (preview_) {
+    auto buf = ToBuffer(preview_->Buffer());
+    preview_.reset();
+    if (buf.IsEmpty()) {
+      auto err = Nan::Error("Cannot create preview buffer");
+      resolver->Reject(Nan::GetCurrentContext(), err).IsNothing();
+      return;
+    }
+    Nan::Set(
+        result.As<Object>(),
+        Nan::New("preview").ToLocalChecked(),
+        buf.ToLocalChecked());
+  }
+  resolver->Resolve(Nan::GetCurrentContext(), result).IsNothing();
+}
+
+void Optimizer::HandleErrorCallback()
+{
+  Nan::HandleScope scope;
+  GetFromPersistent("out");
+  compress_.reset();
+  preview_.reset();
+  Job::HandleErrorCallback();
+}
+
+Estimator::Estimator(
+    Local<Promise::Resolver>& res, Local<ArrayBufferView>& buf, Flags flags)
+    : Job("jpegestimate", res, buf, flags)
+{
+}
+
+void Estimator::Execute()
+{
+  ErrorManager err;
+  if (setjmp(err.setjmp_buffer)) {  // NOLINT
+    invalid_ = err.invalid();
+    if (err) {
+      return SetErrorMessage(err.msg());
+    }
+    return SetErrorMessage("Invalid Image");
+  }
+
+  PrepareMarkers();
+
+  Decompress dec(&err, stripMeta_, stripICC_);
+  dec.init(buffer_, len_);
+  const auto coefs = ReadCoefficients(dec, true);
+  if (err) {
+    return SetErrorMessage(err.msg());
+  }
+  if (coefs == nullptr) {
+    return SetErrorMessage("Invalid image");
+  }
+
+  Compress comp(dec);
+  HuffmanStats stats;
+  if (collector_) {
+    stats.Gather(comp, collector_->Components());
+  }
+  else {
+    stats.Gather(comp, dec, coefs);
+  }
+  size_ = EstimateSize(
+      comp, dec, coefs, stats, MarkerBytes(SelectMarkers(dec)));
+}
+
+void Estimator::HandleOKCallback()
+{
+  Nan::HandleScope scope;
+  GetFromPersistent("buf");
+  auto resolver = GetFromPersistent("res").As<Promise::Resolver>();
+  auto size = Nan::New<Number>(size_);
+  resolver->Resolve(Nan::GetCurrentContext(), size).IsNothing();
+}
+
+#ifdef HAS_JXL
+JxlRecompressor::JxlRecompressor(
+    Local<Promise::Resolver>& res, Local<ArrayBufferView>& buf)
+    : Job("jxlrecompress", res, buf, StripNone)
+{
+}
+
+void JxlRecompressor::Execute()
+{
+  std::unique_ptr<JxlEncoder, jxlencd> enc(JxlEncoderCreate(nullptr));
+  if (!enc) {
+    return SetErrorMessage("Cannot create JPEG XL encoder");
+  }
+  // The reconstruction data lives in a box of its own
+  if (JxlEncoderUseContainer(enc.get(), JXL_TRUE) != JXL_ENC_SUCCESS ||
+      JxlEncoderStoreJPEGMetadata(enc.get(), JXL_TRUE) != JXL_ENC_SUCCESS) {
+    return SetErrorMessage("Cannot set up JPEG XL encoder");
+  }
+  // libjxl parses the JPEG itself, as it has to reproduce its exact bytes
+  const auto settings = JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+  if (settings == nullptr ||
+      JxlEncoderAddJPEGFrame(settings, buffer_, len_) != JXL_ENC_SUCCESS) {
+    invalid_ = true;
+    return SetErrorMessage("Cannot recompress image");
+  }
+  JxlEncoderCloseInput(enc.get());
+
+  out_ = std::make_unique<std::vector<uint8_t>>(len_);
+  auto next = out_->data();
+  auto avail = out_->size();
+  auto status = JxlEncoderProcessOutput(enc.get(), &next, &avail);
+  while (status == JXL_ENC_NEED_MORE_OUTPUT) {
+    const auto used = next - out_->data();
+    out_->resize(out_->size() * 2);
+    next = out_->data() + used;
+    avail = out_->size() - used;
+    status = JxlEncoderProcessOutput(enc.get(), &next, &avail);
+  }
+  if (status != JXL_ENC_SUCCESS) {
+    out_.reset();
+    return SetErrorMessage("Cannot recompress image");
+  }
+  out_->resize(next - out_->data());
+}
+
+void JxlRecompressor::HandleOKCallback()
+{
+  Nan::HandleScope scope;
+  GetFromPersistent("buf");
+  auto resolver = GetFromPersistent("res").As<Promise::Resolver>();
+  auto buf = ToBuffer(std::move(out_));
+  if (buf.IsEmpty()) {
+    auto err = Nan::Error("Cannot create output buffer");
+    resolver->Reject(Nan::GetCurrentContext(), err).IsNothing();
+    return;
+  }
+  resolver->Resolve(Nan::GetCurrentContext(), buf.ToLocalChecked())
+      .IsNothing();
+}
+
+JxlReconstructor::JxlReconstructor(
+    Local<Promise::Resolver>& res, Local<ArrayBufferView>& buf)
+    : Job("jxlreconstruct", res, buf, StripNone)
+{
+}
+
+void JxlReconstructor::Execute()
+{
+  std::unique_ptr<JxlDecoder, jxldecd> dec(JxlDecoderCreate(nullptr));
+  if (!dec) {
+    return SetErrorMessage("Cannot create JPEG XL decoder");
+  }
+  if (JxlDecoderSubscribeEvents(
+          dec.get(), JXL_DEC_JPEG_RECONSTRUCTION | JXL_DEC_FULL_IMAGE) !=
+          JXL_DEC_SUCCESS ||
+      JxlDecoderSetInput(dec.get(), buffer_, len_) != JXL_DEC_SUCCESS) {
+    return SetErrorMessage("Cannot set up JPEG XL decoder");
+  }
+  JxlDecoderCloseInput(dec.get());
+
+  for (;;) {
+    switch (JxlDecoderProcessInput(dec.get())) {
+    case JXL_DEC_JPEG_RECONSTRUCTION:
+      // Recompressed JPEGs hardly ever get larger than that
+      out_ = std::make_unique<std::vector<uint8_t>>(len_ + len_ / 2 + 4096);
+      JxlDecoderSetJPEGBuffer(dec.get(), out_->data(), out_->size());
       break;
 
-    case JPEG_APP0 + 13:
-      if (stripMeta_) {
-        break;
-      }
-      if (marker->data_length > TAG_IPTC_LEN &&
-          memcmp(marker->data, TAG_IPTC, TAG_IPTC_LEN) == 0) {
-        mrks.push_back(marker);
-      }
+    case JXL_DEC_JPEG_NEED_MORE_OUTPUT: {
+      const auto used = out_->size() - JxlDecoderReleaseJPEGBuffer(dec.get());
+      out_->resize(out_->size() * 2);
+      JxlDecoderSetJPEGBuffer(
+          dec.get(), out_->data() + used, out_->size() - used);
       break;
+    }
 
+    case JXL_DEC_FULL_IMAGE:
+      if (!out_) {
+        invalid_ = true;
+        return SetErrorMessage("No JPEG reconstruction data");
+      }
+      out_->resize(out_->size() - JxlDecoderReleaseJPEGBuffer(dec.get()));
+      return;
+
+    case JXL_DEC_NEED_IMAGE_OUT_BUFFER:
+      // Only pixels to be had
+      out_.reset();
+      invalid_ = true;
+      return SetErrorMessage("No JPEG reconstruction data");
+
+    case JXL_DEC_SUCCESS:
+      // Not seen FULL_IMAGE yet, so there is no image at all
+    case JXL_DEC_NEED_MORE_INPUT:
     default:
-      // no copy mr roboto
-      break;
+      out_.reset();
+      invalid_ = true;
+      return SetErrorMessage("Invalid JPEG XL image");
     }
-    marker = marker->next;
   }
+}
 
-  std::sort(
-      mrks.begin(), mrks.end(), [](decltype(marker) a, decltype(marker) b) {
-        return a->marker < b->marker;
-      });
-
-  for (const auto& m : mrks) {
-#ifdef HAS_EXIF
-    if (m->marker == JPEG_APP0 + 1 && !replacementExif.empty()) {
-      jpeg_write_marker(
-          compress_.get(), m->marker,
-          reinterpret_cast<const uint8_t*>(replacementExif.data()),
-          replacementExif.size());
-      replacementExif.clear();
-    }
-    else
-#endif
-    {
-      jpeg_write_marker(compress_.get(), m->marker, m->data, m->data_length);
-    }
-    if (err) {
-      compress_.reset();
-      SetErrorMessage(err.msg());
-      return false;
-    }
+void JxlReconstructor::HandleOKCallback()
+{
+  Nan::HandleScope scope;
+  GetFromPersistent("buf");
+  auto resolver = GetFromPersistent("res").As<Promise::Resolver>();
+  auto buf = ToBuffer(std::move(out_));
+  if (buf.IsEmpty()) {
+    auto err = Nan::Error("Cannot create output buffer");
+    resolver->Reject(Nan::GetCurrentContext(), err).IsNothing();
+    return;
   }
+  resolver->Resolve(Nan::GetCurrentContext(), buf.ToLocalChecked())
+      .IsNothing();
+}
+#endif
 
-  return true;
+Analyzer::Analyzer(
+    Local<Promise::Resolver>& res, Local<ArrayBufferView>& buf, Flags flags)
+    : Job("jpeganalyze", res, buf, flags)
+{
 }
 
-void Optimizer::Execute()
+void Analyzer::Execute()
 {
   ErrorManager err;
   if (setjmp(err.setjmp_buffer)) {  // NOLINT
@@ -317,30 +2438,9 @@ void Optimizer::Execute()
     return SetErrorMessage("Invalid Image");
   }
 
-#ifdef HAS_EXIF
-  if (!stripMeta_ && stripThumb_) {
-    std::unique_ptr<ExifData, ed> exif(exif_data_new_from_data(buffer_, len_));
-    if (exif && exif->data != nullptr && exif->size > 0) {
-      free(exif->data);  // NOLINT
-      exif->data = nullptr;
-      exif->size = 0;
-      exif_data_fix(exif.get());
-
-      unsigned char* data;
-      unsigned int len;
-      exif_data_save_data(exif.get(), &data, &len);
-      std::unique_ptr<char, free_deleter<char>> pdata(
-          reinterpret_cast<char*>(data));
-      if (pdata && len > 0) {
-        replacementExif = std::string(pdata.get(), len);
-      }
-    }
-  }
-#endif
-
-  Decompress dec(&err, stripMeta_, stripICC_);
+  Decompress dec(&err, true, true);
   dec.init(buffer_, len_);
-  const auto coefs = jpeg_read_coefficients(&dec);
+  const auto coefs = ReadCoefficients(dec);
   if (err) {
     return SetErrorMessage(err.msg());
   }
@@ -348,78 +2448,183 @@ void Optimizer::Execute()
     return SetErrorMessage("Invalid image");
   }
 
-  if (outbuf_ != nullptr) {
-    compress_ = std::make_unique<Compress>(dec, outbuf_, outlen_);
-  }
-  else {
-    compress_ = std::make_unique<Compress>(dec, len_);
-  }
-  compress_->Init(coefs);
-  if (err) {
-    compress_.reset();
-    SetErrorMessage(err.msg());
-    return;
+  width_ = dec.image_width;
+  height_ = dec.image_height;
+  colorSpace_ = dec.jpeg_color_space;
+  progressive_ = dec.progressive_mode != 0;
+  for (const auto tbl : dec.quant_tbl_ptrs) {
+    std::vector<uint16_t> table;
+    if (tbl != nullptr) {
+      table.assign(tbl->quantval, tbl->quantval + DCTSIZE2);
+    }
+    tables_.push_back(std::move(table));
   }
-
-  if (!CopyMarkers(err, dec)) {
-    return;
+  const auto luma = dec.quant_tbl_ptrs[dec.comp_info[0].quant_tbl_no];
+  const auto chroma = dec.num_components > 1 &&
+          dec.comp_info[1].quant_tbl_no != dec.comp_info[0].quant_tbl_no
+      ? dec.quant_tbl_ptrs[dec.comp_info[1].quant_tbl_no]
+      : nullptr;
+  quality_ = EstimateQuality(luma, chroma);
+
+  comps_.resize(dec.num_components);
+  for (int ci = 0; ci < dec.num_components; ++ci) {
+    const auto& c = dec.comp_info[ci];
+    comps_[ci].id = c.component_id;
+    comps_[ci].h = c.h_samp_factor;
+    comps_[ci].v = c.v_samp_factor;
+    comps_[ci].quantTable = c.quant_tbl_no;
   }
 
-  compress_->Finish();
-  if (err) {
-    compress_.reset();
-    SetErrorMessage(err.msg());
-    return;
+  // A single pass, coding like a sequential scan would
+  const auto info = reinterpret_cast<j_common_ptr>(&dec);
+  int lastdc[MAX_COMPONENTS]{};
+  AnalysisSink sink;
+  ForEachBlock(dec, coefs, [&](int ci, const JCOEF* block) {
+    sink.stats = &comps_[ci];
+    CodeBlock(info, block, lastdc[ci], sink);
+  });
+
+  // Code lengths from the frequencies of the table slots the optimizer
+  // would assign, which may be shared between components
+  Compress comp(dec);
+  HuffmanStats stats;
+  stats.Gather(comp, comps_);
+  HuffmanTable dctbls[NUM_HUFF_TBLS];
+  HuffmanTable actbls[NUM_HUFF_TBLS];
+  bool dcdone[NUM_HUFF_TBLS]{};
+  bool acdone[NUM_HUFF_TBLS]{};
+  for (int ci = 0; ci < dec.num_components; ++ci) {
+    const auto dc = comp.comp_info[ci].dc_tbl_no;
+    const auto ac = comp.comp_info[ci].ac_tbl_no;
+    if (!dcdone[dc]) {
+      dctbls[dc].Optimize(info, stats.dc[dc]);
+      dcdone[dc] = true;
+    }
+    if (!acdone[ac]) {
+      actbls[ac].Optimize(info, stats.ac[ac]);
+      acdone[ac] = true;
+    }
+    auto& c = comps_[ci];
+    c.bits = c.extraBits;
+    for (int i = 0; i < 256; ++i) {
+      c.bits += c.dc[i] * dctbls[dc].sizes[i] + c.ac[i] * actbls[ac].sizes[i];
+    }
   }
 }
 
-void Optimizer::HandleOKCallback()
+void Analyzer::HandleOKCallback()
 {
   Nan::HandleScope scope;
   GetFromPersistent("buf");
-  GetFromPersistent("out");
   auto resolver = GetFromPersistent("res").As<Promise::Resolver>();
-  if (!compress_) {
-    auto err = Nan::Error("Unknown error");
-    resolver->Reject(Nan::GetCurrentContext(), err).IsNothing();
-    return;
-  }
-  auto dest = compress_->Buffer();
-  compress_.reset();
-  if (!dest->Managed()) {
-    auto length = Nan::New<Number>(dest->Length());
-    resolver->Resolve(Nan::GetCurrentContext(), length).IsNothing();
-    dest.reset();
-    return;
+
+  const char* colorSpace;
+  switch (colorSpace_) {
+  case JCS_GRAYSCALE:
+    colorSpace = "Grayscale";
+    break;
+  case JCS_RGB:
+    colorSpace = "RGB";
+    break;
+  case JCS_YCbCr:
+    colorSpace = "YCbCr";
+    break;
+  case JCS_CMYK:
+    colorSpace = "CMYK";
+    break;
+  case JCS_YCCK:
+    colorSpace = "YCCK";
+    break;
+  default:
+    colorSpace = "Unknown";
+    break;
   }
 
-  auto isolate = Isolate::GetCurrent();
-  auto buf = node::Buffer::New(
-      isolate, reinterpret_cast<char*>(dest->Data()), dest->Length(),
-      MemoryDestination::destroy, nullptr);
-  if (buf.IsEmpty()) {
-    auto err = Nan::Error("Cannot create output buffer");
-    resolver->Reject(Nan::GetCurrentContext(), err).IsNothing();
-    return;
+  // Common names where there are any, else HxV per component
+  std::string subsampling;
+  const auto chroma = [&](int h, int v) {
+    return comps_[1].h == 1 && comps_[1].v == 1 && comps_[2].h == 1 &&
+        comps_[2].v == 1 && comps_[0].h == h && comps_[0].v == v;
+  };
+  if (comps_.size() == 3 && chroma(1, 1)) {
+    subsampling = "4:4:4";
+  }
+  else if (comps_.size() == 3 && chroma(2, 1)) {
+    subsampling = "4:2:2";
+  }
+  else if (comps_.size() == 3 && chroma(2, 2)) {
+    subsampling = "4:2:0";
+  }
+  else if (comps_.size() == 3 && chroma(1, 2)) {
+    subsampling = "4:4:0";
+  }
+  else if (comps_.size() == 3 && chroma(4, 1)) {
+    subsampling = "4:1:1";
+  }
+  else {
+    for (const auto& c : comps_) {
+      if (!subsampling.empty()) {
+        subsampling += ",";
+      }
+      subsampling += std::to_string(c.h) + "x" + std::to_string(c.v);
+    }
   }
 
-  auto lbuf = buf.ToLocalChecked();
-  new Holder<MemoryDestination>(isolate, lbuf, std::move(dest));
-  resolver->Resolve(Nan::GetCurrentContext(), lbuf).IsNothing();
-}
+  auto tables = Nan::New<v8::Array>();
+  for (uint32_t i = 0; i < tables_.size(); ++i) {
+    if (tables_[i].empty()) {
+      Nan::Set(tables, i, Nan::Null());
+      continue;
+    }
+    auto table = Nan::New<v8::Array>();
+    for (uint32_t k = 0; k < DCTSIZE2; ++k) {
+      Nan::Set(table, k, Nan::New<Number>(tables_[i][k]));
+    }
+    Nan::Set(tables, i, table);
+  }
 
-void Optimizer::HandleErrorCallback()
-{
-  Nan::HandleScope scope;
-  GetFromPersistent("buf");
-  GetFromPersistent("out");
-  compress_.reset();
+  auto comps = Nan::New<v8::Array>();
+  for (uint32_t i = 0; i < comps_.size(); ++i) {
+    const auto& c = comps_[i];
+    const auto blocks = static_cast<double>(std::max<size_t>(c.blocks, 1));
+    auto comp = Nan::New<Object>();
+    Nan::Set(comp, Nan::New("id").ToLocalChecked(), Nan::New(c.id));
+    Nan::Set(comp, Nan::New("h").ToLocalChecked(), Nan::New(c.h));
+    Nan::Set(comp, Nan::New("v").ToLocalChecked(), Nan::New(c.v));
+    Nan::Set(
+        comp, Nan::New("quantTable").ToLocalChecked(),
+        Nan::New(c.quantTable));
+    Nan::Set(
+        comp, Nan::New("blocks").ToLocalChecked(),
+        Nan::New<Number>(c.blocks));
+    Nan::Set(
+        comp, Nan::New("bitsPerBlock").ToLocalChecked(),
+        Nan::New<Number>(c.bits / blocks));
+    Nan::Set(
+        comp, Nan::New("zeroDensity").ToLocalChecked(),
+        Nan::New<Number>(1.0 - c.nonzero / (blocks * (DCTSIZE2 - 1))));
+    Nan::Set(
+        comp, Nan::New("zeroRuns").ToLocalChecked(),
+        Nan::New<Number>(c.runs / blocks));
+    Nan::Set(comps, i, comp);
+  }
 
-  auto resolver = GetFromPersistent("res").As<Promise::Resolver>();
-  auto err = Nan::Error(ErrorMessage()).As<Object>();
-  Nan::DefineOwnProperty(
-      err, Nan::New("invalid").ToLocalChecked(), Nan::New(invalid_));
-  resolver->Reject(Nan::GetCurrentContext(), err).IsNothing();
+  auto rv = Nan::New<Object>();
+  Nan::Set(rv, Nan::New("width").ToLocalChecked(), Nan::New<Number>(width_));
+  Nan::Set(rv, Nan::New("height").ToLocalChecked(), Nan::New<Number>(height_));
+  Nan::Set(
+      rv, Nan::New("colorSpace").ToLocalChecked(),
+      Nan::New(colorSpace).ToLocalChecked());
+  Nan::Set(
+      rv, Nan::New("progressive").ToLocalChecked(),
+      Nan::New(progressive_));
+  Nan::Set(
+      rv, Nan::New("subsampling").ToLocalChecked(),
+      Nan::New(subsampling).ToLocalChecked());
+  Nan::Set(rv, Nan::New("quality").ToLocalChecked(), Nan::New(quality_));
+  Nan::Set(rv, Nan::New("quantTables").ToLocalChecked(), tables);
+  Nan::Set(rv, Nan::New("components").ToLocalChecked(), comps);
+  resolver->Resolve(Nan::GetCurrentContext(), rv).IsNothing();
 }
 
 JBLOCKARRAY get_row(Decompress* dec, jvirt_barray_ptr *coefs, JDIMENSION compNum, JDIMENSION rowNum)
@@ -500,7 +2705,7 @@ NAN_METHOD(optimize)
   }
 
   const auto flags =
-      static_cast<jpegoptim::StripFlags>(Nan::To<uint32_t>(info[1]).FromJust());
+      static_cast<jpegoptim::Flags>(Nan::To<uint32_t>(info[1]).FromJust());
 #ifndef HAS_EXIF
   if ((flags & jpegoptim::StripThumbnail) == jpegoptim::StripThumbnail) {
     return Nan::ThrowRangeError(
@@ -509,7 +2714,7 @@ NAN_METHOD(optimize)
 #endif
 
   MaybeLocal<ArrayBufferView> outbuf;
-  if (info.Length() > 2) {
+  if (info.Length() > 2 && !info[2]->IsUndefined()) {
     if (!info[2]->IsArrayBufferView()) {
       return Nan::ThrowTypeError("Expected an output buffer");
     }
@@ -523,13 +2728,191 @@ NAN_METHOD(optimize)
     outbuf = lobuf;
   }
 
+  int previewQuality = 0;
+  if ((flags & jpegoptim::PreviewMask) != 0) {
+    if (info.Length() < 4) {
+      return Nan::ThrowTypeError("Expected a preview quality");
+    }
+    previewQuality = Nan::To<int32_t>(info[3]).FromJust();
+    if (previewQuality < 1 || previewQuality > 100) {
+      return Nan::ThrowRangeError("Preview quality must be within 1 and 100");
+    }
+  }
+
+  int maxQuality = 0;
+  if (info.Length() > 4 && !info[4]->IsUndefined()) {
+    maxQuality = Nan::To<int32_t>(info[4]).FromJust();
+    if (maxQuality < 1 || maxQuality > 100) {
+      return Nan::ThrowRangeError("Max quality must be within 1 and 100");
+    }
+  }
+
+  auto resolver =
+      Promise::Resolver::New(Nan::GetCurrentContext()).ToLocalChecked();
+  auto promise = resolver->GetPromise();
+  Nan::AsyncQueueWorker(new jpegoptim::Optimizer(
+      resolver, buf, outbuf, flags, previewQuality, maxQuality));
+  info.GetReturnValue().Set(promise);
+}
+
+NAN_METHOD(estimate)
+{
+  Nan::HandleScope scope;
+  if (info.Length() < 2 || !node::Buffer::HasInstance(info[0])) {
+    return Nan::ThrowTypeError("Expected a buffer and flags");
+  }
+
+  if (!info[0]->IsArrayBufferView()) {
+    return Nan::ThrowTypeError("Expected a buffer");
+  }
+  auto buf = info[0].As<ArrayBufferView>();
+  if (buf->ByteLength() <= 0) {
+    return Nan::ThrowTypeError("Expected a filled buffer");
+  }
+
+  const auto flags =
+      static_cast<jpegoptim::Flags>(Nan::To<uint32_t>(info[1]).FromJust());
+#ifndef HAS_EXIF
+  if ((flags & jpegoptim::StripThumbnail) == jpegoptim::StripThumbnail) {
+    return Nan::ThrowRangeError(
+        "node-jpegoptim was compiled without libexif support; cannot stripThumbnail");
+  }
+#endif
+
+  auto resolver =
+      Promise::Resolver::New(Nan::GetCurrentContext()).ToLocalChecked();
+  auto promise = resolver->GetPromise();
+  Nan::AsyncQueueWorker(new jpegoptim::Estimator(resolver, buf, flags));
+  info.GetReturnValue().Set(promise);
+}
+
+NAN_METHOD(mpfread)
+{
+  using namespace jpegoptim;
+  Nan::HandleScope scope;
+  if (info.Length() < 1 || !info[0]->IsArrayBufferView()) {
+    return Nan::ThrowTypeError("Expected a buffer");
+  }
+  auto buf = info[0].As<ArrayBufferView>();
+  const auto len = buf->ByteLength();
+
+  MPFIndex index;
+  if (!index.Read(BufferData(buf), len) || !index.Valid(len)) {
+    return;
+  }
+
+  auto images = Nan::New<v8::Array>();
+  uint32_t n = 0;
+  for (size_t i = 1; i < index.entries.size(); ++i) {
+    if (!index.Present(i)) {
+      continue;
+    }
+    const auto& e = index.entries[i];
+    auto image = Nan::New<Object>();
+    Nan::Set(
+        image, Nan::New("offset").ToLocalChecked(),
+        Nan::New<Number>(index.base + e.offset));
+    Nan::Set(image, Nan::New("size").ToLocalChecked(), Nan::New<Number>(e.size));
+    Nan::Set(images, n++, image);
+  }
+  auto rv = Nan::New<Object>();
+  Nan::Set(rv, Nan::New("images").ToLocalChecked(), images);
+  Nan::Set(
+      rv, Nan::New("directory").ToLocalChecked(), Nan::New(index.directory));
+  info.GetReturnValue().Set(rv);
+}
+
+NAN_METHOD(mpfwrite)
+{
+  using namespace jpegoptim;
+  Nan::HandleScope scope;
+  if (info.Length() < 3 || !info[0]->IsArrayBufferView() ||
+      !info[1]->IsArray() || !info[2]->IsArray()) {
+    return Nan::ThrowTypeError("Expected a buffer, sizes and offsets");
+  }
+  auto buf = info[0].As<ArrayBufferView>();
+  const auto numbers = [](Local<v8::Array> array) {
+    std::vector<uint32_t> rv;
+    for (uint32_t i = 0; i < array->Length(); ++i) {
+      rv.push_back(
+          Nan::To<uint32_t>(Nan::Get(array, i).ToLocalChecked()).FromJust());
+    }
+    return rv;
+  };
+  const auto sizes = numbers(info[1].As<v8::Array>());
+  const auto offsets = numbers(info[2].As<v8::Array>());
+
+  MPFIndex index;
+  const auto data = BufferData(buf);
+  const auto rv = index.Read(data, buf->ByteLength()) &&
+      index.Write(data, sizes, offsets);
+  info.GetReturnValue().Set(Nan::New(rv));
+}
+
+NAN_METHOD(analyze)
+{
+  Nan::HandleScope scope;
+  if (info.Length() < 2 || !node::Buffer::HasInstance(info[0])) {
+    return Nan::ThrowTypeError("Expected a buffer and flags");
+  }
+
+  if (!info[0]->IsArrayBufferView()) {
+    return Nan::ThrowTypeError("Expected a buffer");
+  }
+  auto buf = info[0].As<ArrayBufferView>();
+  if (buf->ByteLength() <= 0) {
+    return Nan::ThrowTypeError("Expected a filled buffer");
+  }
+
+  const auto flags =
+      static_cast<jpegoptim::Flags>(Nan::To<uint32_t>(info[1]).FromJust());
+  auto resolver =
+      Promise::Resolver::New(Nan::GetCurrentContext()).ToLocalChecked();
+  auto promise = resolver->GetPromise();
+  Nan::AsyncQueueWorker(new jpegoptim::Analyzer(resolver, buf, flags));
+  info.GetReturnValue().Set(promise);
+}
+
+template<class T>
+void QueueJxl(const Nan::FunctionCallbackInfo<Value>& info)
+{
+  Nan::HandleScope scope;
+  if (info.Length() < 1 || !node::Buffer::HasInstance(info[0]) ||
+      !info[0]->IsArrayBufferView()) {
+    return Nan::ThrowTypeError("Expected a buffer");
+  }
+  auto buf = info[0].As<ArrayBufferView>();
+  if (buf->ByteLength() <= 0) {
+    return Nan::ThrowTypeError("Expected a filled buffer");
+  }
+
   auto resolver =
       Promise::Resolver::New(Nan::GetCurrentContext()).ToLocalChecked();
   auto promise = resolver->GetPromise();
-  Nan::AsyncQueueWorker(new jpegoptim::Optimizer(resolver, buf, outbuf, flags));
+  Nan::AsyncQueueWorker(new T(resolver, buf));
   info.GetReturnValue().Set(promise);
 }
 
+NAN_METHOD(recompress)
+{
+#ifdef HAS_JXL
+  QueueJxl<jpegoptim::JxlRecompressor>(info);
+#else
+  Nan::ThrowRangeError(
+      "node-jpegoptim was compiled without libjxl support; cannot recompress");
+#endif
+}
+
+NAN_METHOD(reconstruct)
+{
+#ifdef HAS_JXL
+  QueueJxl<jpegoptim::JxlReconstructor>(info);
+#else
+  Nan::ThrowRangeError(
+      "node-jpegoptim was compiled without libjxl support; cannot reconstruct");
+#endif
+}
+
 #ifdef __GNUC__
 #  pragma GCC visibility pop
 #endif
@@ -539,9 +2922,27 @@ NAN_MODULE_INIT(InitAll)
   Nan::Set(
       target, Nan::New("_optimize").ToLocalChecked(),
       Nan::GetFunction(Nan::New<FunctionTemplate>(optimize)).ToLocalChecked());
+  Nan::Set(
+      target, Nan::New("_estimate").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(estimate)).ToLocalChecked());
+  Nan::Set(
+      target, Nan::New("_analyze").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(analyze)).ToLocalChecked());
   Nan::Set(
       target, Nan::New("_dumpdct").ToLocalChecked(),
       Nan::GetFunction(Nan::New<FunctionTemplate>(dumpdct)).ToLocalChecked());
+  Nan::Set(
+      target, Nan::New("_mpfread").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(mpfread)).ToLocalChecked());
+  Nan::Set(
+      target, Nan::New("_mpfwrite").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(mpfwrite)).ToLocalChecked());
+  Nan::Set(
+      target, Nan::New("_recompress").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(recompress)).ToLocalChecked());
+  Nan::Set(
+      target, Nan::New("_reconstruct").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(reconstruct)).ToLocalChecked());
 
   Local<Object> versions = Nan::New<Object>();
   jpegoptim::ErrorManager err;
@@ -559,7 +2960,25 @@ NAN_MODULE_INIT(InitAll)
     versions, Nan::New("LIBEXIF_VERSION").ToLocalChecked(), Nan::New("Unknown").ToLocalChecked());
 #endif
 
+#ifdef HAS_JXL
+  const auto jxl = JxlEncoderVersion();
+  const auto jxlversion = std::to_string(jxl / 1000000) + "." +
+      std::to_string(jxl / 1000 % 1000) + "." + std::to_string(jxl % 1000);
+  Nan::Set(
+    versions, Nan::New("LIBJXL_VERSION").ToLocalChecked(), Nan::New(jxlversion).ToLocalChecked());
+#endif
+
   Nan::Set(target, Nan::New("_versions").ToLocalChecked(), versions);
+
+  // mozjpeg does not tell its version apart from the libjpeg-turbo one
+#ifdef JPEG_C_PARAM_SUPPORTED
+  const auto scanOptimization = true;
+#else
+  const auto scanOptimization = false;
+#endif
+  Nan::Set(
+      target, Nan::New("_scanOptimization").ToLocalChecked(),
+      Nan::New(scanOptimization));
 }
 
 NODE_MODULE(binding, InitAll)
@@ -1,6 +1,9 @@
 {
     "variables": {
         "exif": "<!(pkg-config --exists libexif && echo yes || echo no)",
+        "jxl": "<!(pkg-config --exists 'libjxl >= 0.7' && echo yes || echo no)",
+        # pkg-config package to build against, e.g. a mozjpeg one
+        "libjpeg%": "libjpeg",
     },
     "targets": [{
         "target_name": "binding",
@@ -9,7 +12,7 @@
         ],
         "include_dirs": [
             "<!(node -e \"require('nan')\")",
-            "<!@(pkg-config --cflags-only-I libjpeg | sed s/-I//g)",
+            "<!@(pkg-config --cflags-only-I <(libjpeg) | sed s/-I//g)",
         ],
         "cflags_cc": [
             "-Wstrict-aliasing",
@@ -18,7 +21,7 @@
             "-mtune=generic"
         ],
         "libraries": [
-            '<!@(pkg-config --libs libjpeg)',
+            '<!@(pkg-config --libs <(libjpeg))',
         ],
         "conditions": [
             ['exif=="yes"', {
@@ -31,6 +34,17 @@
                 "libraries": [
                     '<!@(pkg-config --libs libexif)',
                 ],
+            }],
+            ['jxl=="yes"', {
+                "include_dirs": [
+                    "<!@(pkg-config --cflags-only-I libjxl | sed s/-I//g)",
+                ],
+                "defines": [
+                    "HAS_JXL=1",
+                ],
+                "libraries": [
+                    '<!@(pkg-config --libs libjxl)',
+                ],
             }]
         ]
     }]
@@ -3,7 +3,10 @@
 #include <cinttypes>
 #include <csetjmp>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <limits>
+#include <vector>
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -15,6 +18,11 @@
 #  include <libexif/exif-data.h>
 #endif
 
+#ifdef HAS_JXL
+#  include <jxl/decode.h>
+#  include <jxl/encode.h>
+#endif
+
 #include <nan.h>
 
 #ifdef __GNUC__
@@ -22,11 +30,28 @@
 #endif
 
 namespace jpegoptim {
-enum StripFlags : uint32_t {
+enum Flags : uint32_t {
   StripNone = 0,
   StripMeta = 1u << 0u,
   StripICC = 1u << 1u,
   StripThumbnail = 1u << 2u,
+  SkipOptimal = 1u << 3u,
+  LowMemory = 1u << 4u,
+  EffortMask = 3u << 5u,
+  PreviewMask = 3u << 7u,  // scale denominator 2, 4, 8 (log2)
+  Grayscale = 1u << 9u,
+  Container = 1u << 10u,  // keep the MPF index, report the image length
+  MetadataOnly = 1u << 11u,  // copy the entropy coded data as is
+  KeepMPF = 1u << 12u,  // keep MPF segments, e.g. of an embedded image
+};
+
+constexpr const uint32_t EffortShift = 5;
+constexpr const uint32_t PreviewShift = 7;
+
+enum Effort : uint32_t {
+  EffortFast = 0,  // sequential, optimized huffman tables only
+  EffortProgressive = 1,
+  EffortMax = 2,  // sequential and progressive, keep the smaller one
 };
 
 template<typename T>
@@ -50,6 +75,26 @@ struct ed {
 };
 #endif
 
+#ifdef HAS_JXL
+struct jxlencd {
+  void operator()(JxlEncoder* e) const
+  {
+    if (e != nullptr) {
+      JxlEncoderDestroy(e);
+    }
+  }
+};
+
+struct jxldecd {
+  void operator()(JxlDecoder* d) const
+  {
+    if (d != nullptr) {
+      JxlDecoderDestroy(d);
+    }
+  }
+};
+#endif
+
 class ErrorManager : public jpeg_error_mgr {
   std::string errmsg_{};
   bool ok_{true};
@@ -94,11 +139,15 @@ class ErrorManager : public jpeg_error_mgr {
 
 class Decompress : public jpeg_decompress_struct {
   bool inited_{false};
+  const bool keepMPF_;
 
  public:
   explicit Decompress(
-      ErrorManager* errmgr, const bool stripMeta, const bool stripICC)
-      : jpeg_decompress_struct{}
+      ErrorManager* errmgr,
+      const bool stripMeta,
+      const bool stripICC,
+      const bool keepMPF = false)
+      : jpeg_decompress_struct{}, keepMPF_{keepMPF}
   {
     err = errmgr;
     jpeg_create_decompress(static_cast<jpeg_decompress_struct*>(this));
@@ -106,8 +155,8 @@ class Decompress : public jpeg_decompress_struct {
       jpeg_save_markers(this, JPEG_APP0 + 1, 0xffff);  // EXIF / XMP
       jpeg_save_markers(this, JPEG_APP0 + 13, 0xffff);  // IPTC
     }
-    if (!stripICC) {
-      jpeg_save_markers(this, JPEG_APP0 + 2, 0xffff);  // ICC
+    if (!stripICC || keepMPF) {
+      jpeg_save_markers(this, JPEG_APP0 + 2, 0xffff);  // ICC / MPF
     }
   }
 
@@ -130,18 +179,173 @@ class Decompress : public jpeg_decompress_struct {
     jpeg_read_header(this, static_cast<boolean>(TRUE));
     inited_ = true;
   }
+
+  // The entropy coded data is consumed elsewhere (CoefficientStream), or
+  // not at all, so there is nothing libjpeg could finish.
+  inline void SkipFinish()
+  {
+    inited_ = false;
+  }
+
+  inline bool KeepMPF() const
+  {
+    return keepMPF_;
+  }
+};
+
+// Caps the quality of an image at some IJG quality setting, right in the
+// coefficient domain: each quantization table finer than the scaled sample
+// table is coarsened to it (but never made finer), and the coefficients
+// quantized again, rounding to the nearest.
+class Requantizer {
+  uint16_t from_[MAX_COMPONENTS][DCTSIZE2]{};
+  uint16_t to_[MAX_COMPONENTS][DCTSIZE2]{};
+  bool changed_[MAX_COMPONENTS]{};
+  bool active_{false};
+
+ public:
+  // Against the tables the components latched, or else the slots
+  Requantizer(Decompress& dec, int maxQuality);
+
+  explicit inline operator bool() const
+  {
+    return active_;
+  }
+
+  inline void Block(int ci, JCOEF* coef) const
+  {
+    if (!changed_[ci]) {
+      return;
+    }
+    for (int i = 0; i < DCTSIZE2; i++) {
+      if (coef[i] == 0 || from_[ci][i] == to_[ci][i]) {
+        continue;
+      }
+      const auto q = static_cast<int>(to_[ci][i]);
+      const auto v = static_cast<int>(coef[i]) * from_[ci][i];
+      const auto r = (std::abs(v) + q / 2) / q;
+      coef[i] = static_cast<JCOEF>(v < 0 ? -r : r);
+    }
+  }
+
+  // Requantize whole-image arrays, as from jpeg_read_coefficients, from
+  // iMCU row first up to last
+  void Apply(
+      Decompress& dec,
+      jvirt_barray_ptr* coefs,
+      JDIMENSION first = 0,
+      JDIMENSION last = std::numeric_limits<JDIMENSION>::max()) const;
+
+  // Put the new tables in place, to be copied to a compressor
+  void Install(Decompress& dec) const;
+};
+
+// Stands in for the whole-image virtual block arrays jpeg_read_coefficients
+// would allocate, decoding the entropy coded data of a single-scan
+// sequential huffman image one iMCU row at a time instead.
+// Attached compressors (and ForEachBlock) then only ever see the current
+// iMCU row; every new pass over the image re-decodes the input from the
+// start.
+class CoefficientStream {
+  using access_fn = decltype(jpeg_memory_mgr::access_virt_barray);
+
+  struct Component {
+    std::unique_ptr<JBLOCK[]> blocks;
+    std::vector<JBLOCKROW> rows;
+    JDIMENSION width{0};  // in blocks, padded to full MCUs
+    JDIMENSION height{0};  // block rows per iMCU row
+  };
+
+  Decompress& dec_;
+  const uint8_t* data_;
+  const uint8_t* end_;
+  access_fn access_{nullptr};
+
+  Component comps_[MAX_COMPONENTS];
+  jvirt_barray_ptr arrays_[MAX_COMPONENTS]{};
+  JDIMENSION mcuCols_{0};
+  JDIMENSION mcuRows_{0};
+  JDIMENSION row_{0};  // next iMCU row to decode
+
+  // Bit reader state
+  const uint8_t* pos_{nullptr};
+  uint64_t bitbuf_{0};
+  int bits_{0};
+  bool marker_{false};
+  int lastdc_[MAX_COMPS_IN_SCAN]{};
+  unsigned int restarts_{0};
+  int nextrst_{0};
+  std::unique_ptr<Requantizer> requant_;
+
+  // Derived decoding tables, jdhuff.c style
+  struct DecodeTable {
+    long maxcode[18];
+    long valoffset[17];
+    uint16_t lookup[256];  // (length << 8) | symbol, or 0
+    const JHUFF_TBL* tbl;
+  };
+  DecodeTable dctbls_[NUM_HUFF_TBLS]{};
+  DecodeTable actbls_[NUM_HUFF_TBLS]{};
+
+  static JBLOCKARRAY access(
+      j_common_ptr info,
+      jvirt_barray_ptr ptr,
+      JDIMENSION start,
+      JDIMENSION num,
+      boolean writable);
+
+  void Fill();
+  int Bits(int n);
+  int Decode(const DecodeTable& tbl);
+  void Restart();
+  void Rewind();
+  void DecodeRow();
+
+ public:
+  explicit CoefficientStream(Decompress& dec);
+
+  explicit CoefficientStream(const CoefficientStream&) = delete;
+  explicit CoefficientStream(CoefficientStream&&) = delete;
+  CoefficientStream& operator=(const CoefficientStream&) = delete;
+  CoefficientStream& operator=(CoefficientStream&&) = delete;
+
+  ~CoefficientStream() = default;
+
+  // Requantize blocks as they are decoded
+  inline void Requantize(const Requantizer& requant)
+  {
+    requant_ = std::make_unique<Requantizer>(requant);
+  }
+
+  // Sequential, huffman coded, 8-bit, and all components in the first scan
+  static bool Supported(Decompress& dec);
+
+  // Serve our arrays to this (de)compressor
+  void Attach(j_common_ptr info);
+
+  inline jvirt_barray_ptr* Arrays()
+  {
+    return arrays_;
+  }
 };
 
 class MemoryDestination;
+struct HuffmanStats;
 
 class Compress : public jpeg_compress_struct {
   std::unique_ptr<MemoryDestination> dst_;
   bool inited_{false};
   bool finished_{false};
 
+  void Defaults(Decompress& dec);
+
  public:
+  // Parameters only, without any destination; never to be started
+  explicit Compress(Decompress& dec);
   explicit Compress(Decompress& dec, size_t memhint);
   explicit Compress(Decompress& dec, uint8_t* buffer, size_t capacity);
+  // Re-encode the (started) decompressor's output pixels
+  explicit Compress(Decompress& dec, size_t memhint, int quality);
 
   explicit Compress(const Compress&) = delete;
   explicit Compress(Compress&&) = delete;
@@ -153,12 +357,43 @@ class Compress : public jpeg_compress_struct {
     jpeg_destroy_compress(this);
   }
 
+  inline void Progressive()
+  {
+#ifdef JPEG_C_PARAM_SUPPORTED
+    // mozjpeg: search for the best scan script, too
+    jpeg_c_set_bool_param(
+        this, JBOOLEAN_OPTIMIZE_SCANS, static_cast<boolean>(TRUE));
+#endif
+    jpeg_simple_progression(this);
+  }
+
+  // Keep only the luminance component. Its block grid does not change, as
+  // luminance has the full sampling factors anyway.
+  inline void Grayscale()
+  {
+    const auto luma = comp_info[0];
+    jpeg_set_colorspace(this, JCS_GRAYSCALE);
+    comp_info[0].component_id = luma.component_id;
+    comp_info[0].quant_tbl_no = luma.quant_tbl_no;
+  }
+
+  // Huffman code with optimal tables made from statistics gathered
+  // beforehand, writing in a single pass instead of having optimize_coding
+  // gather them in another. Sequential only.
+  void OptimalTables(const HuffmanStats& stats);
+
   inline void Init(jvirt_barray_ptr* coefs)
   {
     jpeg_write_coefficients(this, coefs);
     inited_ = true;
   }
 
+  inline void Start()
+  {
+    jpeg_start_compress(this, static_cast<boolean>(TRUE));
+    inited_ = true;
+  }
+
   inline void Finish()
   {
     if (!inited_ || finished_) {
@@ -315,15 +550,157 @@ class UnmanagedMemoryDestination : public MemoryDestination {
   }
 };
 
-class Optimizer : public Nan::AsyncWorker {
-  std::unique_ptr<Compress> compress_;
+// Coefficient statistics of a component, as coded in a sequential scan
+struct ComponentStats {
+  int id{0};
+  int h{1};
+  int v{1};
+  int quantTable{0};
+  long dc[257]{};  // symbol frequencies
+  long ac[257]{};
+  size_t blocks{0};
+  size_t extraBits{0};  // magnitude bits following the symbols
+  size_t nonzero{0};  // non-zero AC coefficients
+  size_t runs{0};  // runs of zero AC coefficients
+  size_t bits{0};  // all of it, under the tables the optimizer would write
+};
+
+// Huffman table as the encoder would derive it, i.e. with codes assigned
+struct HuffmanTable {
+  uint8_t bits[17]{};
+  uint8_t vals[256]{};
+  unsigned int codes[256]{};
+  uint8_t sizes[256]{};
+
+  // Build an optimal table from the symbol frequencies, the same way
+  // libjpeg's optimize_coding does.
+  void Optimize(j_common_ptr info, const long* freq);
+};
+
+// Symbol frequencies of a single sequential scan, per table slot
+struct HuffmanStats {
+  long dc[NUM_HUFF_TBLS][257]{};
+  long ac[NUM_HUFF_TBLS][257]{};
+
+  void Gather(Compress& comp, Decompress& dec, jvirt_barray_ptr* coefs);
+  // Merge the frequencies of components sharing table slots
+  void Gather(Compress& comp, const std::vector<ComponentStats>& comps);
+};
+
+// Counts the symbols of a sequential image having all components in a single
+// scan while jpeg_read_coefficients decodes it: each iMCU row is counted as
+// soon as the decoder moves on to the next one, while its blocks are still in
+// cache, instead of in another pass over the whole image afterwards.
+class StatsCollector {
+  using access_fn = decltype(jpeg_memory_mgr::access_virt_barray);
+
+  Decompress& dec_;
+  access_fn access_{nullptr};
+  jvirt_barray_ptr arrays_[MAX_COMPONENTS]{};
+  int seen_{0};  // arrays the decoder requested so far
+  JDIMENSION row_{0};  // next iMCU row to count
+  int lastdc_[MAX_COMPONENTS]{};
+  std::vector<ComponentStats> comps_;
+  std::unique_ptr<Requantizer> requant_;
+
+  static JBLOCKARRAY access(
+      j_common_ptr info,
+      jvirt_barray_ptr ptr,
+      JDIMENSION start,
+      JDIMENSION num,
+      boolean writable);
+
+  void Count(jvirt_barray_ptr* coefs, JDIMENSION rows);
+
+ public:
+  explicit StatsCollector(Decompress& dec);
+
+  explicit StatsCollector(const StatsCollector&) = delete;
+  explicit StatsCollector(StatsCollector&&) = delete;
+  StatsCollector& operator=(const StatsCollector&) = delete;
+  StatsCollector& operator=(StatsCollector&&) = delete;
+
+  ~StatsCollector() = default;
+
+  // Sequential, 8-bit, and all components in the first scan
+  static bool Supported(Decompress& dec);
 
+  // Watch the decoder store the coefficients
+  void Attach();
+  // Count the rows still left once all coefficients were read, and detach
+  void Finish(jvirt_barray_ptr* coefs);
+
+  // Requantize rows before counting them
+  inline void Requantize(const Requantizer& requant)
+  {
+    requant_ = std::make_unique<Requantizer>(requant);
+  }
+
+  inline const std::vector<ComponentStats>& Components() const
+  {
+    return comps_;
+  }
+};
+
+// Predict the size Optimizer output will have, given the symbol statistics
+// and the total size of the markers that would be copied, without actually
+// encoding anything.
+size_t EstimateSize(
+    Compress& comp,
+    Decompress& dec,
+    jvirt_barray_ptr* coefs,
+    const HuffmanStats& stats,
+    size_t markerBytes);
+
+// Is this a YCbCr image whose chroma carries nothing but neutral gray,
+// i.e. every Cb and Cr coefficient is zero (DC included, being level
+// shifted)?
+bool IsNeutralChroma(Decompress& dec, jvirt_barray_ptr* coefs);
+
+// The index of a Multi-Picture Format (CIPA DC-007) container, as found in
+// an APP2 marker of its first image
+struct MPFIndex {
+  struct Entry {
+    size_t field;  // position of the size field, followed by the offset
+    uint32_t size;
+    uint32_t offset;  // relative to base; 0 for the first image
+  };
+
+  size_t base{0};  // position of the TIFF header offsets refer to
+  bool little{false};
+  bool directory{false};  // an XMP container directory lists item lengths
+  std::vector<Entry> entries;
+
+  // Parse the header of the first image
+  bool Read(const uint8_t* data, size_t len);
+  // Do the images all lie after the first one, in order, within len?
+  bool Valid(size_t len) const;
+  // Update the index for images stored in index order, at the given
+  // positions in data. sizes and offsets hold one entry per present image,
+  // the first image included.
+  bool Write(
+      uint8_t* data,
+      const std::vector<uint32_t>& sizes,
+      const std::vector<uint32_t>& offsets) const;
+
+  inline bool Present(size_t i) const
+  {
+    return entries[i].size != 0 && (i == 0 || entries[i].offset != 0);
+  }
+};
+
+// A saved marker, as it will be written
+struct Marker {
+  int code;
+  const uint8_t* data;
+  unsigned int length;
+};
+
+class Job : public Nan::AsyncWorker {
+ protected:
   const uint8_t* buffer_;
   const size_t len_;
 
-  uint8_t* outbuf_{};
-  size_t outlen_{};
-
 #ifdef HAS_EXIF
   std::string replacementExif{};
 #endif
@@ -335,15 +712,89 @@ class Optimizer : public Nan::AsyncWorker {
 #endif
   bool stripMeta_;
   bool stripICC_;
+  bool lowMemory_;
+
+  std::unique_ptr<CoefficientStream> stream_;
+  std::unique_ptr<StatsCollector> collector_;
+
+  void PrepareMarkers();
+  std::vector<Marker> SelectMarkers(Decompress& dec) const;
+  // Also collect the symbol statistics along the way, if so asked and
+  // possible, and requantize, if given
+  jvirt_barray_ptr* ReadCoefficients(
+      Decompress& dec,
+      bool collect = false,
+      const Requantizer* requant = nullptr);
 
-  bool CopyMarkers(ErrorManager& err, Decompress& dec);
+ public:
+  explicit Job(
+      const char* name,
+      v8::Local<v8::Promise::Resolver>& res,
+      v8::Local<v8::ArrayBufferView>& buf,
+      Flags flags);
+
+  explicit Job(const Job&) = delete;
+  explicit Job(Job&&) = delete;
+  Job& operator=(const Job&) = delete;
+  Job& operator=(Job&&) = delete;
+
+  ~Job() override = default;
+
+  void HandleErrorCallback() override;
+};
+
+class Optimizer : public Job {
+  std::unique_ptr<Compress> compress_;
+  std::unique_ptr<Compress> preview_;
+
+  uint8_t* outbuf_{};
+  size_t outlen_{};
+
+  Effort effort_;
+  unsigned int previewScale_;
+  int previewQuality_;
+  int maxQuality_;
+  bool skipOptimal_;
+  bool collapseGray_;
+  bool collapsed_{false};
+  bool container_;
+  bool keepMPF_;
+  bool metadataOnly_;
+  size_t end_{0};
+  bool skipped_{false};
+  bool copied_{false};
+  // For sequential output, once known
+  std::unique_ptr<HuffmanStats> stats_;
+  // The input with its markers replaced, see Splice
+  std::unique_ptr<std::vector<uint8_t>> spliced_;
+
+  // The size of the input image, without anything trailing it, once known
+  inline size_t InputLength() const
+  {
+    return end_ != 0 ? end_ : len_;
+  }
+
+  bool CopyMarkers(ErrorManager& err, Compress& comp, Decompress& dec);
+  bool Skip(Decompress& dec, jvirt_barray_ptr* coefs);
+  bool TablesOptimal(Decompress& dec);
+  bool Splice(Decompress& dec);
+  void KeepInput();
+  bool Preview(ErrorManager& err);
+  std::unique_ptr<Compress> Encode(
+      ErrorManager& err,
+      Decompress& dec,
+      jvirt_barray_ptr* coefs,
+      bool progressive,
+      bool direct);
 
  public:
   explicit Optimizer(
       v8::Local<v8::Promise::Resolver>& res,
       v8::Local<v8::ArrayBufferView>& buf,
       v8::MaybeLocal<v8::ArrayBufferView>& outbuf,
-      StripFlags flags);
+      Flags flags,
+      int previewQuality,
+      int maxQuality);
 
   explicit Optimizer(const Optimizer&) = delete;
   explicit Optimizer(Optimizer&&) = delete;
@@ -357,6 +808,95 @@ class Optimizer : public Nan::AsyncWorker {
   void HandleErrorCallback() final;
 };
 
+class Estimator : public Job {
+  size_t size_{0};
+
+ public:
+  explicit Estimator(
+      v8::Local<v8::Promise::Resolver>& res,
+      v8::Local<v8::ArrayBufferView>& buf,
+      Flags flags);
+
+  explicit Estimator(const Estimator&) = delete;
+  explicit Estimator(Estimator&&) = delete;
+  Estimator& operator=(const Estimator&) = delete;
+  Estimator& operator=(Estimator&&) = delete;
+
+  ~Estimator() final = default;
+
+  void Execute() final;
+  void HandleOKCallback() final;
+};
+
+class Analyzer : public Job {
+  JDIMENSION width_{0};
+  JDIMENSION height_{0};
+  J_COLOR_SPACE colorSpace_{JCS_UNKNOWN};
+  bool progressive_{false};
+  int quality_{0};
+  std::vector<std::vector<uint16_t>> tables_;  // by slot, natural order
+  std::vector<ComponentStats> comps_;
+
+ public:
+  explicit Analyzer(
+      v8::Local<v8::Promise::Resolver>& res,
+      v8::Local<v8::ArrayBufferView>& buf,
+      Flags flags);
+
+  explicit Analyzer(const Analyzer&) = delete;
+  explicit Analyzer(Analyzer&&) = delete;
+  Analyzer& operator=(const Analyzer&) = delete;
+  Analyzer& operator=(Analyzer&&) = delete;
+
+  ~Analyzer() final = default;
+
+  void Execute() final;
+  void HandleOKCallback() final;
+};
+
+#ifdef HAS_JXL
+// Losslessly recompress a JPEG to JPEG XL, keeping what is needed to
+// reconstruct the very same JPEG bytes again
+class JxlRecompressor : public Job {
+  std::unique_ptr<std::vector<uint8_t>> out_;
+
+ public:
+  explicit JxlRecompressor(
+      v8::Local<v8::Promise::Resolver>& res,
+      v8::Local<v8::ArrayBufferView>& buf);
+
+  explicit JxlRecompressor(const JxlRecompressor&) = delete;
+  explicit JxlRecompressor(JxlRecompressor&&) = delete;
+  JxlRecompressor& operator=(const JxlRecompressor&) = delete;
+  JxlRecompressor& operator=(JxlRecompressor&&) = delete;
+
+  ~JxlRecompressor() final = default;
+
+  void Execute() final;
+  void HandleOKCallback() final;
+};
+
+// Reconstruct the original JPEG from a recompressed JPEG XL
+class JxlReconstructor : public Job {
+  std::unique_ptr<std::vector<uint8_t>> out_;
+
+ public:
+  explicit JxlReconstructor(
+      v8::Local<v8::Promise::Resolver>& res,
+      v8::Local<v8::ArrayBufferView>& buf);
+
+  explicit JxlReconstructor(const JxlReconstructor&) = delete;
+  explicit JxlReconstructor(JxlReconstructor&&) = delete;
+  JxlReconstructor& operator=(const JxlReconstructor&) = delete;
+  JxlReconstructor& operator=(JxlReconstructor&&) = delete;
+
+  ~JxlReconstructor() final = default;
+
+  void Execute() final;
+  void HandleOKCallback() final;
+};
+#endif
+
 }  // namespace jpegoptim
 
 #ifdef __GNUC__
@@ -1,11 +1,32 @@
 "use strict";
 
-const {_optimize, _dumpdct, _versions} = require("./build/Release/binding");
+const {
+  _optimize, _estimate, _analyze, _dumpdct, _mpfread, _mpfwrite,
+  _recompress, _reconstruct, _versions, _scanOptimization
+} = require("./build/Release/binding");
 
 const StripNone = 0;
 const StripMeta = 1 << 0;
 const StripICC = 1 << 1;
 const StripThumbnail = 1 << 2;
+const SkipOptimal = 1 << 3;
+const LowMemory = 1 << 4;
+const EffortShift = 5;
+const PreviewShift = 7;
+const Grayscale = 1 << 9;
+const Container = 1 << 10;
+const MetadataOnly = 1 << 11;
+const KeepMPF = 1 << 12;
+
+// Options of images embedded in an MPF container, which keep their own MPF
+// segment (holding their MP attributes)
+const Embedded = Symbol("embedded");
+
+const EffortFast = 0;
+const EffortMax = 2;
+
+// denominator -> log2
+const PreviewScales = new Map([[2, 1], [4, 2], [8, 3]]);
 
 /**
  * Something bad happened
@@ -17,6 +38,112 @@ Object.defineProperty(OptimizeError.prototype, "name", {
   enumerable: true
 });
 
+function convertError(ex) {
+  const {stack, invalid = false} = ex;
+  if (ex.name === "RangeError") {
+    // eslint-disable-next-line no-ex-assign
+    ex = new RangeError(ex.message || ex);
+  }
+  else if (ex.name === "TypeError") {
+    // eslint-disable-next-line no-ex-assign
+    ex = new TypeError(ex.message || ex);
+  }
+  else {
+    // eslint-disable-next-line no-ex-assign
+    ex = new OptimizeError(ex.message || ex);
+  }
+  ex.stack = stack || ex.stack;
+  Object.defineProperty(ex, "invalid", {
+    value: invalid,
+    enumerable: true,
+  });
+  return ex;
+}
+
+function toFlags(options) {
+  const {
+    strip = false, stripICC = false, stripThumbnail = false, lowMemory = false
+  } = options;
+  let flags = StripNone;
+  if (strip) {
+    flags |= StripMeta;
+  }
+  if (stripICC) {
+    flags |= StripICC;
+  }
+  if (stripThumbnail) {
+    flags |= StripThumbnail;
+  }
+  if (lowMemory) {
+    flags |= LowMemory;
+  }
+  return flags;
+}
+
+/**
+ * Put the optimized image back together with whatever followed it in the
+ * input: images indexed by an MPF container, and any other trailing
+ * payloads around them, as they are and where they were.
+ * @private
+ */
+function assemble(buf, image, length, index, images, out) {
+  const parts = [image];
+  const offsets = [0];
+  let trailing = 0;
+  let at = image.length;
+  let pos = length;
+  const add = part => {
+    parts.push(part);
+    at += part.length;
+  };
+  (index ? index.images : []).forEach(({offset, size}, i) => {
+    // In order and apart, as far as _mpfread is concerned
+    if (offset > pos) {
+      trailing += offset - pos;
+      add(buf.subarray(pos, offset));
+    }
+    offsets.push(at);
+    add(images[i]);
+    pos = offset + size;
+  });
+  if (pos < buf.length) {
+    trailing += buf.length - pos;
+    add(buf.subarray(pos));
+  }
+  if (parts.length === 1) {
+    return image;
+  }
+  let rv;
+  if (out) {
+    if (at > out.length) {
+      throw new OptimizeError("Buffer too small");
+    }
+    // The image was written to the start of out already
+    rv = out.slice(0, at);
+    let start = image.length;
+    for (const part of parts.slice(1)) {
+      rv.set(part, start);
+      start += part.length;
+    }
+  }
+  else {
+    rv = Buffer.concat(parts, at);
+  }
+  if (index) {
+    // Only the index in the primary image is read and updated; the MPF
+    // segments of the embedded images hold no offsets to other images
+    const sizes = [image.length, ...images.map(image => image.length)];
+    _mpfwrite(rv, sizes, offsets);
+  }
+
+  if (trailing) {
+    Object.defineProperty(rv, "trailing", {
+      value: trailing,
+      enumerable: true,
+    });
+  }
+  return rv;
+}
 
 /**
  * Optimize some JPEG image in memory.
@@ -33,7 +160,67 @@ Object.defineProperty(OptimizeError.prototype, "name", {
  * @param {Boolean} [options.stripThumbnail]
  *   Strip any EXIF thumbnail present in the image metadata. Requires that this
  *   module was compiled against libexif.
- * @returns {Promise<Buffer>} The optimized jpeg.
+ * @param {Boolean} [options.skipOptimal]
+ *   Predict the output size first (see estimate), and do not bother writing
+ *   the output if it would not be smaller than the input. In that case the
+ *   input is returned as is (or copied to out).
+ * @param {Boolean} [options.lowMemory]
+ *   Do not keep the coefficients of the whole image in memory, but decode
+ *   them one MCU row at a time, once per pass. Peak memory then does not
+ *   depend on the image size, at the expense of decoding twice.
+ *   The output is the same.
+ *   Only applies to sequential (baseline) images having all components in
+ *   a single scan; other images are processed as usual.
+ * @param {Number} [options.effort]
+ *   How hard to try:
+ *   0 (default) writes a sequential jpeg with optimized huffman tables only.
+ *   1 writes a progressive jpeg instead (with scan optimization, if this
+ *     module was compiled against mozjpeg), which is usually smaller for
+ *     all but small images, but slower.
+ *   2 writes both, and keeps the smaller one.
+ * @param {Boolean} [options.grayscale]
+ *   Check whether a color (YCbCr) image is gray only, i.e. carries no
+ *   chroma at all, and if so drop the chroma components, writing a
+ *   single-component jpeg. The luminance stays exactly the same.
+ *   The resulting image then has a grayscale property set to true.
+ * @param {Boolean} [options.keepTrailing]
+ *   Keep what follows the image, instead of dropping it (along with any MPF
+ *   index) as usual.
+ *   Images embedded in a Multi-Picture Format (MPF) container, such as
+ *   depth maps or HDR gain maps, are then optimized as well (in parallel,
+ *   keeping their metadata) and put back after the image with the MPF index
+ *   updated. Embedded images whose sizes are also listed in an XMP container
+ *   directory are kept as they are.
+ *   Embedded images that cannot be processed are kept as they are, with
+ *   the OptimizeErrors set as the embeddedErrors property of the resulting
+ *   image; any other error is thrown.
+ *   Any other trailing data is kept as is, and its size set as the
+ *   trailing property of the resulting image.
+ *   Neither is covered by estimate.
+ * @param {Boolean} [options.metadataOnly]
+ *   Only replace the metadata segments as requested, copying the entropy
+ *   coded data as is, without decoding (or even re-encoding) it at all.
+ *   Much faster, but the huffman tables are not optimized, and effort and
+ *   grayscale do not apply. With the default effort, this is done anyway
+ *   whenever the huffman tables of the image already are optimal.
+ *   Does not apply either if the image needs to be requantized for
+ *   maxQuality.
+ * @param {Number} [options.maxQuality]
+ *   Cap the quality (1-100, as in IJG/libjpeg quality settings), which
+ *   makes this lossy: images whose quantization tables are finer than
+ *   those of this quality get these tables instead, and their DCT
+ *   coefficients are requantized accordingly, rounding to the nearest.
+ *   There is no decoding to pixels involved, so no further loss from
+ *   another IDCT and color conversion either. Images already at or below
+ *   that quality are left as they are.
+ * @param {Object} [options.preview]
+ *   Also produce a downscaled preview jpeg, decoding at reduced size right
+ *   away using libjpeg's DCT scaling.
+ *   The result will then be an object of {image, preview} buffers.
+ * @param {Number} [options.preview.scale]
+ *   Scale down by 2, 4 or 8 (default).
+ * @param {Number} [options.preview.quality] Quality of the preview (75).
+ * @returns {Promise<Buffer|Object>} The optimized jpeg.
  *
  * @throws TypeError
  * @throws RangeError
@@ -42,18 +229,47 @@ Object.defineProperty(OptimizeError.prototype, "name", {
  * @property {OptimizeError} OptimizeError Reference to OptimizeError
  * @property {Object} versions Library version of libjpeg etc
  * @property {Boolean} supportsThumbnailStripping Does this build support it?
+ * @property {Boolean} supportsScanOptimization
+ *   Was this module compiled against mozjpeg?
+ * @property {Boolean} supportsJxl
+ *   Was this module compiled against libjxl (see recompress)?
  */
 async function optimize(buf, options = {}) {
-  const {strip = false, stripICC = false, stripThumbnail = false} = options;
-  let flags = StripNone;
-  if (strip) {
-    flags |= StripMeta;
+  const {effort = EffortFast} = options;
+  if (!Number.isInteger(effort) || effort < EffortFast || effort > EffortMax) {
+    throw new RangeError(
+      `effort must be an integer between ${EffortFast} and ${EffortMax}`);
   }
-  if (stripICC) {
-    flags |= StripICC;
+  let flags = toFlags(options) | (effort << EffortShift);
+  if (options.skipOptimal) {
+    flags |= SkipOptimal;
   }
-  if (stripThumbnail) {
-    flags |= StripThumbnail;
+  const {preview, grayscale = false, keepTrailing = false} = options;
+  if (grayscale) {
+    flags |= Grayscale;
+  }
+  const {metadataOnly = false, maxQuality} = options;
+  if (metadataOnly) {
+    flags |= MetadataOnly;
+  }
+  if (options[Embedded]) {
+    flags |= KeepMPF;
+  }
+  if (typeof maxQuality !== "undefined" &&
+      (!Number.isInteger(maxQuality) || maxQuality < 1 || maxQuality > 100)) {
+    throw new RangeError("maxQuality must be an integer between 1 and 100");
+  }
+  let previewQuality;
+  if (preview) {
+    const {scale = 8, quality = 75} = preview;
+    if (!PreviewScales.has(scale)) {
+      throw new RangeError("preview.scale must be 2, 4 or 8");
+    }
+    if (!Number.isInteger(quality) || quality < 1 || quality > 100) {
+      throw new RangeError("preview.quality must be between 1 and 100");
+    }
+    flags |= PreviewScales.get(scale) << PreviewShift;
+    previewQuality = quality;
   }
 
   let {out} = options;
@@ -61,32 +277,159 @@ async function optimize(buf, options = {}) {
     out = Buffer.allocUnsafe(out);
   }
   try {
-    if (out) {
-      const len = await _optimize(buf, flags, out);
-      return out.slice(0, len);
+    let index;
+    let embedded = [];
+    const failed = [];
+    if (keepTrailing) {
+      flags |= Container;
+      index = _mpfread(buf);
     }
-    return await _optimize(buf, flags);
-  }
-  catch (ex) {
-    const {stack, invalid = false} = ex;
-    if (ex.name === "RangeError") {
-      // eslint-disable-next-line no-ex-assign
-      ex = new RangeError(ex.message || ex);
+    if (index) {
+      // Each on its own, in parallel; the primary image carries the index
+      const {lowMemory, skipOptimal} = options;
+      embedded = index.images.map(({offset, size}) => {
+        const image = buf.subarray(offset, offset + size);
+        if (index.directory) {
+          // Sizes are recorded in XMP as well, so better leave them be
+          return image;
+        }
+        const opts = {
+          effort, lowMemory, skipOptimal, metadataOnly, maxQuality,
+          [Embedded]: true,
+        };
+        return optimize(image, opts).catch(ex => {
+          if (!(ex instanceof OptimizeError)) {
+            throw ex;
+          }
+          // Cannot be processed, so keep it as it is
+          failed.push(ex);
+          return image;
+        });
+      });
     }
-    else if (ex.name === "TypeError") {
-      // eslint-disable-next-line no-ex-assign
-      ex = new TypeError(ex.message || ex);
+    const [rv, ...images] = await Promise.all([
+      _optimize(buf, flags, out, previewQuality, maxQuality), ...embedded]);
+    if (!preview && !grayscale && !keepTrailing) {
+      return out ? out.slice(0, rv) : rv;
     }
-    else {
-      // eslint-disable-next-line no-ex-assign
-      ex = new OptimizeError(ex.message || ex);
+    let image = out ? out.slice(0, rv.image) : rv.image;
+    if (keepTrailing) {
+      image = assemble(buf, image, rv.length, index, images, out);
     }
-    ex.stack = stack || ex.stack;
-    Object.defineProperty(ex, "invalid", {
-      value: invalid,
-      enumerable: true,
-    });
-    throw ex;
+    if (failed.length) {
+      Object.defineProperty(image, "embeddedErrors", {
+        value: failed,
+        enumerable: true,
+      });
+    }
+    if (rv.grayscale) {
+      Object.defineProperty(image, "grayscale", {
+        value: true,
+        enumerable: true,
+      });
+    }
+    return preview ? {image, preview: rv.preview} : image;
+  }
+  catch (ex) {
+    throw convertError(ex);
+  }
+}
+
+/**
+ * Predict the size of optimizing some JPEG, without actually writing it.
+ *
+ * Gathers the huffman statistics of the image only, and computes the
+ * size of the entropy coded data under optimal tables, plus the size of the
+ * markers that would be kept.
+ * With libjpeg-turbo this is exact, other libraries might deviate slightly.
+ *
+ * @param {Buffer} buf Buffer containing the JPEG to estimate
+ * @param {Object} [options]
+ *   Same as the stripping and lowMemory options of optimize.
+ * @returns {Promise<Number>} The predicted size of the optimized jpeg.
+ *
+ * @throws TypeError
+ * @throws RangeError
+ * @throws OptimizeError
+ */
+async function estimate(buf, options = {}) {
+  try {
+    return await _estimate(buf, toFlags(options));
+  }
+  catch (ex) {
+    throw convertError(ex);
+  }
+}
+
+/**
+ * Inspect how an image is coded, e.g. to decide how to treat it.
+ *
+ * Reads the coefficients once and gathers everything in that single pass.
+ *
+ * @param {Buffer} buf Buffer containing the JPEG to analyze
+ * @param {Object} [options]
+ * @param {Boolean} [options.lowMemory] See optimize.
+ * @returns {Promise<Object>}
+ *   width, height, colorSpace, progressive,
+ *   subsampling (e.g. "4:2:0", or h x v factors per component),
+ *   quality (the closest IJG quality setting, 1-100),
+ *   quantTables (64 values in natural order per table slot, or null),
+ *   components (id, h, v, quantTable, blocks, and per block on average:
+ *   bitsPerBlock under optimal huffman tables, zeroRuns of zero AC
+ *   coefficients, plus zeroDensity, the share of AC coefficients that
+ *   are zero).
+ *
+ * @throws TypeError
+ * @throws RangeError
+ * @throws OptimizeError
+ */
+async function analyze(buf, options = {}) {
+  try {
+    return await _analyze(buf, toFlags({lowMemory: options.lowMemory}));
+  }
+  catch (ex) {
+    throw convertError(ex);
+  }
+}
+
+/**
+ * Losslessly recompress a JPEG to JPEG XL, keeping the data needed to
+ * reconstruct the very same JPEG file later on (see reconstruct).
+ * Requires that this module was compiled against libjxl.
+ *
+ * @param {Buffer} buf Buffer containing the JPEG to recompress
+ * @returns {Promise<Buffer>} The JPEG XL image.
+ *
+ * @throws TypeError
+ * @throws RangeError
+ * @throws OptimizeError
+ */
+async function recompress(buf) {
+  try {
+    return await _recompress(buf);
+  }
+  catch (ex) {
+    throw convertError(ex);
+  }
+}
+
+/**
+ * Reconstruct the original JPEG bytes from a JPEG XL made by recompress.
+ * Requires that this module was compiled against libjxl.
+ *
+ * @param {Buffer} jxl Buffer containing the JPEG XL image
+ * @returns {Promise<Buffer>} The original JPEG.
+ *
+ * @throws TypeError
+ * @throws RangeError
+ * @throws OptimizeError
+ */
+async function reconstruct(jxl) {
+  try {
+    return await _reconstruct(jxl);
+  }
+  catch (ex) {
+    throw convertError(ex);
   }
 }
 
@@ -116,33 +459,21 @@ function dumpdct(buf, func) {
     _dumpdct(buf, func);
   }
   catch (ex) {
-    const {stack, invalid = false} = ex;
-    if (ex.name === "RangeError") {
-      // eslint-disable-next-line no-ex-assign
-      ex = new RangeError(ex.message || ex);
-    }
-    else if (ex.name === "TypeError") {
-      // eslint-disable-next-line no-ex-assign
-      ex = new TypeError(ex.message || ex);
-    }
-    else {
-      // eslint-disable-next-line no-ex-assign
-      ex = new OptimizeError(ex.message || ex);
-    }
-    ex.stack = stack || ex.stack;
-    Object.defineProperty(ex, "invalid", {
-      value: invalid,
-      enumerable: true,
-    });
-    throw ex;
+    throw convertError(ex);
   }
 }
 
 
 module.exports = Object.freeze(Object.assign(optimize, {
   optimize,
+  estimate,
+  analyze,
+  recompress,
+  reconstruct,
   dumpdct,
   OptimizeError,
   versions: _versions,
   supportsThumbnailStripping: "LIBEXIF_VERSION" in _versions,
+  supportsScanOptimization: _scanOptimization,
+  supportsJxl: "LIBJXL_VERSION" in _versions,
 }, _versions));
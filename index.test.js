@@ -3,6 +3,11 @@
 
 const optim = require("./");
 const base = require("fs").readFileSync(`${__dirname}/test.jpg`, {encoding: null});
+const gray = require("fs").readFileSync(`${__dirname}/test-gray.jpg`, {encoding: null});
+const mpf = require("fs").readFileSync(`${__dirname}/test-mpf.jpg`, {encoding: null});
+const mpfGap = require("fs").readFileSync(`${__dirname}/test-mpf-gap.jpg`, {encoding: null});
+const mpfAttr = require("fs").readFileSync(`${__dirname}/test-mpf-attr.jpg`, {encoding: null});
+const hq = require("fs").readFileSync(`${__dirname}/test-hq.jpg`, {encoding: null});
 
 describe("globals", function() {
   test("function", function() {
@@ -11,6 +16,8 @@ describe("globals", function() {
     expect(optim.optimize).toBeDefined();
     expect(typeof optim.optimize).toBe("function");
     expect(typeof optim.dumpdct).toBe("function");
+    expect(typeof optim.estimate).toBe("function");
+    expect(typeof optim.analyze).toBe("function");
   });
 
   test("OptimizeError", function() {
@@ -23,6 +30,18 @@ describe("globals", function() {
     expect(typeof optim.supportsThumbnailStripping).toBe("boolean");
   });
 
+  test("supportsScanOptimization", function() {
+    expect(optim.supportsScanOptimization).toBeDefined();
+    expect(typeof optim.supportsScanOptimization).toBe("boolean");
+  });
+
+  test("supportsJxl", function() {
+    expect(optim.supportsJxl).toBeDefined();
+    expect(typeof optim.supportsJxl).toBe("boolean");
+    expect(typeof optim.recompress).toBe("function");
+    expect(typeof optim.reconstruct).toBe("function");
+  });
+
   test("has versions", function() {
     expect(optim.versions).toBeDefined();
     expect(optim.versions.JPEG_VERSION).toBeDefined();
@@ -135,6 +154,415 @@ describe("optimize", function() {
       expect(!opt.equals(opt2)).toBe(true);
     });
   });
+
+  describe("lowMemory", function() {
+    test("same output", async function() {
+      const opt = await optim(base);
+      const opt2 = await optim(base, {lowMemory: true});
+      ensure(opt2);
+      expect(opt.equals(opt2)).toBe(true);
+    });
+
+    test("same output stripped", async function() {
+      const opt = await optim(base, {strip: true});
+      const opt2 = await optim(base, {strip: true, lowMemory: true});
+      expect(opt.equals(opt2)).toBe(true);
+    });
+
+    test("same output if already optimal", async function() {
+      // Without JFIF, which re-encoding would add
+      expect(hq.readUInt16BE(2)).toBe(0xffe0);
+      const input = Buffer.concat(
+        [hq.slice(0, 2), hq.slice(4 + hq.readUInt16BE(4))]);
+      const opt = await optim(input);
+      const opt2 = await optim(input, {lowMemory: true});
+      expect(opt2.equals(opt)).toBe(true);
+    });
+
+    test("same output with skipOptimal", async function() {
+      const opt = await optim(base);
+      const opt2 = await optim(base, {skipOptimal: true, lowMemory: true});
+      expect(opt.equals(opt2)).toBe(true);
+    });
+  });
+
+  describe("grayscale", function() {
+    function dct(buf) {
+      const rows = [];
+      optim.dumpdct(buf, row => rows.push(Buffer.from(row)));
+      return rows;
+    }
+
+    test("collapses", async function() {
+      const opt = await optim(gray);
+      const opt2 = await optim(gray, {grayscale: true});
+      expect(opt.grayscale).toBeUndefined();
+      expect(opt2.grayscale).toBe(true);
+      expect(opt2.length).toBeLessThan(opt.length);
+      const luma = dct(opt2);
+      expect(luma.length).toBeGreaterThan(0);
+      expect(dct(opt).slice(0, luma.length)).toEqual(luma);
+    });
+
+    test("keeps color", async function() {
+      const opt = await optim(base);
+      const opt2 = await optim(base, {grayscale: true});
+      expect(opt2.grayscale).toBeUndefined();
+      expect(opt2.equals(opt)).toBe(true);
+    });
+
+    test("buf out", async function() {
+      const opt = await optim(gray, {grayscale: true});
+      const opt2 = await optim(gray, {
+        grayscale: true, out: Buffer.alloc(gray.length)});
+      expect(opt2.grayscale).toBe(true);
+      expect(opt2.equals(opt)).toBe(true);
+    });
+  });
+
+  describe("trailing", function() {
+    const junk = Buffer.from("junk");
+
+    test("kept", async function() {
+      const opt = await optim(base);
+      const opt2 = await optim(
+        Buffer.concat([base, junk]), {keepTrailing: true});
+      expect(opt2.trailing).toBe(junk.length);
+      expect(opt2.equals(Buffer.concat([opt, junk]))).toBe(true);
+      expect(opt.trailing).toBeUndefined();
+    });
+
+    test("stripped", async function() {
+      const opt = await optim(base);
+      const opt2 = await optim(Buffer.concat([base, junk]));
+      expect(opt2.trailing).toBeUndefined();
+      expect(opt2.equals(opt)).toBe(true);
+    });
+
+    test("stripped skipOptimal", async function() {
+      const opt = await optim(base);
+      const input = Buffer.concat([opt, junk]);
+      const opt2 = await optim(input, {skipOptimal: true});
+      expect(opt2.equals(opt)).toBe(true);
+      const out = Buffer.alloc(input.length);
+      const opt3 = await optim(input, {skipOptimal: true, out});
+      expect(opt3.equals(opt)).toBe(true);
+    });
+
+    test("kept skipOptimal", async function() {
+      const opt = await optim(base);
+      const input = Buffer.concat([opt, junk]);
+      const opt2 = await optim(input, {skipOptimal: true, keepTrailing: true});
+      expect(opt2.trailing).toBe(junk.length);
+      expect(opt2.equals(input)).toBe(true);
+    });
+
+    test("mpf", async function() {
+      const opt = await optim(mpf, {keepTrailing: true});
+      expect(opt.length).toBeLessThan(mpf.length);
+      expect(opt.trailing).toBe("TRAILINGPAYLOAD".length);
+      expect(opt.slice(-opt.trailing).toString()).toBe("TRAILINGPAYLOAD");
+      // The embedded image follows the primary one
+      const soi = Buffer.from([0xff, 0xd8, 0xff]);
+      const start = opt.indexOf(soi, 2);
+      expect(start).toBeGreaterThan(0);
+      const embedded = opt.slice(start, -opt.trailing);
+      const primary = opt.slice(0, start);
+      await expect(optim(embedded)).resolves.toBeInstanceOf(Buffer);
+      await expect(optim(primary)).resolves.toBeInstanceOf(Buffer);
+      expect(embedded.length).toBeLessThan(mpf.length - mpf.indexOf(soi, 2));
+    });
+
+    test("mpf gap", async function() {
+      const gap = "INBETWEEN";
+      const opt = await optim(mpfGap, {keepTrailing: true});
+      expect(opt.trailing).toBe(gap.length + "TRAILINGPAYLOAD".length);
+      // Still right before the embedded image, which the index points to
+      const start = opt.indexOf(Buffer.from([0xff, 0xd8, 0xff]), 2);
+      expect(opt.indexOf(gap)).toBe(start - gap.length);
+      const opt2 = await optim(opt, {keepTrailing: true});
+      expect(opt2.embeddedErrors).toBeUndefined();
+      expect(opt2.trailing).toBe(opt.trailing);
+    });
+
+    test("mpf broken embedded image", async function() {
+      const broken = Buffer.from(mpf);
+      const soi = Buffer.from([0xff, 0xd8, 0xff]);
+      const start = broken.indexOf(soi, 2);
+      const sof = broken.indexOf(Buffer.from([0xff, 0xc0]), start);
+      broken[sof + 4] = 7;  // sample precision
+      const opt = await optim(broken, {keepTrailing: true});
+      expect(opt.embeddedErrors).toHaveLength(1);
+      expect(opt.embeddedErrors[0]).toBeInstanceOf(optim.OptimizeError);
+      const embedded = broken.slice(start, -"TRAILINGPAYLOAD".length);
+      expect(opt.indexOf(embedded)).toBeGreaterThan(0);
+      expect((await optim(mpf, {keepTrailing: true})).embeddedErrors).
+        toBeUndefined();
+    });
+
+    test("mpf embedded attributes", async function() {
+      const soi = Buffer.from([0xff, 0xd8, 0xff]);
+      const app2 = mpfAttr.indexOf(Buffer.from([0xff, 0xe2]),
+        mpfAttr.indexOf(soi, 2));
+      expect(mpfAttr.toString("latin1", app2 + 4, app2 + 8)).toBe("MPF\0");
+      const attrs = mpfAttr.slice(
+        app2, app2 + 2 + mpfAttr.readUInt16BE(app2 + 2));
+      const opt = await optim(mpfAttr, {keepTrailing: true});
+      expect(opt.embeddedErrors).toBeUndefined();
+      const start = opt.indexOf(soi, 2);
+      expect(opt.indexOf(attrs, start)).toBeGreaterThan(start);
+      const index = require("./build/Release/binding")._mpfread(opt);
+      expect(index).toBeDefined();
+      expect(index.images).toHaveLength(1);
+      expect(index.images[0].offset).toBe(start);
+      expect(opt.readUInt16BE(index.images[0].offset)).toBe(0xffd8);
+    });
+
+    test("mpf stripped", async function() {
+      const opt = await optim(mpf, {keepTrailing: true});
+      const opt2 = await optim(mpf);
+      expect(opt2.length).toBeLessThan(opt.length);
+      expect(opt2.indexOf(Buffer.from("MPF\0"))).toBe(-1);
+    });
+
+    test("mpf buf out", async function() {
+      const opt = await optim(mpf, {keepTrailing: true});
+      const out = Buffer.alloc(mpf.length);
+      const opt2 = await optim(mpf, {keepTrailing: true, out});
+      expect(opt2.equals(opt)).toBe(true);
+      await expect(optim(mpf, {keepTrailing: true, out: opt.length - 1})).
+        rejects.toThrow(optim.OptimizeError);
+    });
+  });
+
+  describe("effort", function() {
+    test("bad", async function() {
+      await expect(optim(base, {effort: -1})).rejects.toThrow(RangeError);
+      await expect(optim(base, {effort: 3})).rejects.toThrow(RangeError);
+      await expect(optim(base, {effort: 1.5})).rejects.toThrow(RangeError);
+    });
+
+    test("progressive", async function() {
+      const opt = await optim(base, {effort: 1});
+      ensure(opt);
+      const h = require("crypto").createHash("sha256");
+      const h2 = require("crypto").createHash("sha256");
+      optim.dumpdct(base, d => h.update(d));
+      optim.dumpdct(opt, d => h2.update(d));
+      expect(h2.digest("hex")).toBe(h.digest("hex"));
+    });
+
+    test("max", async function() {
+      const fast = await optim(base);
+      const prog = await optim(base, {effort: 1});
+      const max = await optim(base, {effort: 2});
+      ensure(max);
+      expect(max.length).toBe(Math.min(fast.length, prog.length));
+    });
+
+    test("max buf out", async function() {
+      const max = await optim(base, {effort: 2});
+      const opt = await optim(base, {
+        effort: 2, out: Buffer.alloc(base.length + 1024)});
+      expect(opt.equals(max)).toBe(true);
+    });
+
+    test("lowMemory", async function() {
+      const prog = await optim(base, {effort: 1});
+      const prog2 = await optim(base, {effort: 1, lowMemory: true});
+      expect(prog2.equals(prog)).toBe(true);
+    });
+  });
+
+  describe("preview", function() {
+    test("bad", async function() {
+      await expect(optim(base, {preview: {scale: 3}})).
+        rejects.toThrow(RangeError);
+      await expect(optim(base, {preview: {quality: 0}})).
+        rejects.toThrow(RangeError);
+      await expect(optim(base, {preview: {quality: 101}})).
+        rejects.toThrow(RangeError);
+    });
+
+    test("ok", async function() {
+      const opt = await optim(base);
+      const {image, preview} = await optim(base, {preview: {scale: 4}});
+      ensure(image);
+      expect(image.equals(opt)).toBe(true);
+      expect(Buffer.isBuffer(preview)).toBe(true);
+      expect(preview.length).toBeGreaterThan(0);
+      expect(preview.length).toBeLessThan(image.length);
+    });
+
+    test("scales", async function() {
+      const sizes = [];
+      for (const scale of [2, 4, 8]) {
+        const {preview} = await optim(base, {preview: {scale, quality: 90}});
+        sizes.push(preview.length);
+      }
+      expect(sizes[0]).toBeGreaterThan(sizes[1]);
+      expect(sizes[1]).toBeGreaterThan(sizes[2]);
+    });
+
+    test("buf out", async function() {
+      const opt = await optim(base);
+      const {image, preview} = await optim(base, {
+        out: Buffer.alloc(base.length + 1024), preview: {}});
+      expect(image.equals(opt)).toBe(true);
+      expect(preview.length).toBeGreaterThan(0);
+    });
+  });
+
+  describe("skipOptimal", function() {
+    test("optimizes", async function() {
+      const opt = await optim(base);
+      const opt2 = await optim(base, {skipOptimal: true});
+      ensure(opt2);
+      expect(opt.equals(opt2)).toBe(true);
+    });
+
+    test("skips", async function() {
+      const opt = await optim(base);
+      const opt2 = await optim(opt, {skipOptimal: true});
+      expect(opt2).toBe(opt);
+    });
+
+    test("skips buf out", async function() {
+      const opt = await optim(base);
+      const out = Buffer.alloc(opt.length + 1024);
+      const opt2 = await optim(opt, {skipOptimal: true, out});
+      expect(opt2.equals(opt)).toBe(true);
+    });
+  });
+
+  describe("metadataOnly", function() {
+    const dct = function(buf) {
+      const h = require("crypto").createHash("sha256");
+      optim.dumpdct(buf, d => {
+        h.update(d);
+      });
+      return h.digest("hex");
+    };
+
+    test("same dct", async function() {
+      const opt = await optim(gray, {metadataOnly: true});
+      ensure(opt);
+      expect(dct(opt)).toBe(dct(gray));
+    });
+
+    test("strips", async function() {
+      const opt = await optim(base, {metadataOnly: true, strip: true});
+      ensure(opt);
+      expect(opt.length).toBeLessThan(base.length);
+      expect(dct(opt)).toBe(dct(base));
+    });
+
+    test("idempotent", async function() {
+      const opt = await optim(gray);
+      const opt2 = await optim(opt);
+      expect(opt2.equals(opt)).toBe(true);
+      const opt3 = await optim(opt, {metadataOnly: true});
+      expect(opt3.equals(opt)).toBe(true);
+    });
+  });
+
+  describe("maxQuality", function() {
+    test("bad params", async function() {
+      for (const maxQuality of [0, 101, 1.5, "80"]) {
+        await expect(optim(base, {maxQuality})).rejects.toThrow(RangeError);
+      }
+    });
+
+    test("caps", async function() {
+      const opt = await optim(base);
+      const opt2 = await optim(base, {maxQuality: 50});
+      ensure(opt2);
+      expect(opt2.length).toBeLessThan(opt.length);
+      expect((await optim.analyze(base)).quality).toBeGreaterThan(50);
+      expect((await optim.analyze(opt2)).quality).toBe(50);
+    });
+
+    test("leaves lower quality alone", async function() {
+      const opt = await optim(base);
+      const opt2 = await optim(base, {maxQuality: 95});
+      expect(opt2.equals(opt)).toBe(true);
+    });
+
+    test("caps already optimal", async function() {
+      // Huffman tables are optimal, so this would otherwise be copied as is
+      expect((await optim.analyze(hq)).quality).toBeGreaterThan(90);
+      const opt = await optim(hq, {maxQuality: 90});
+      expect((await optim.analyze(opt)).quality).toBeLessThanOrEqual(90);
+    });
+
+    test("same output lowMemory", async function() {
+      const opt = await optim(base, {maxQuality: 50});
+      const opt2 = await optim(base, {maxQuality: 50, lowMemory: true});
+      expect(opt.equals(opt2)).toBe(true);
+    });
+  });
+});
+
+describe("estimate", function() {
+  test("types", async function() {
+    await expect(optim.estimate()).rejects.toThrow(TypeError);
+    await expect(optim.estimate("err")).rejects.toThrow(TypeError);
+    await expect(optim.estimate(Buffer.alloc(0))).rejects.toThrow(TypeError);
+  });
+
+  test("invalid data", async function() {
+    await expect(optim.estimate(Buffer.from("errror"))).
+      rejects.toThrow(optim.OptimizeError);
+  });
+
+  test("matches optimize", async function() {
+    const opt = await optim(base);
+    expect(await optim.estimate(base)).toBe(opt.length);
+    const stripped = await optim(base, {strip: true});
+    expect(await optim.estimate(base, {strip: true})).toBe(stripped.length);
+  });
+});
+
+describe("analyze", function() {
+  test("types", async function() {
+    await expect(optim.analyze()).rejects.toThrow(TypeError);
+    await expect(optim.analyze("err")).rejects.toThrow(TypeError);
+    await expect(optim.analyze(Buffer.alloc(0))).rejects.toThrow(TypeError);
+  });
+
+  test("invalid data", async function() {
+    await expect(optim.analyze(Buffer.from("errror"))).
+      rejects.toThrow(optim.OptimizeError);
+  });
+
+  test("base", async function() {
+    const info = await optim.analyze(base);
+    expect(info.colorSpace).toBe("YCbCr");
+    expect(info.progressive).toBe(false);
+    expect(info.subsampling).toBe("4:2:0");
+    expect(info.quality).toBeGreaterThanOrEqual(1);
+    expect(info.quality).toBeLessThanOrEqual(100);
+    expect(info.quantTables.length).toBe(4);
+    expect(info.quantTables[0].length).toBe(64);
+    expect(info.components.length).toBe(3);
+    for (const comp of info.components) {
+      expect(comp.blocks).toBeGreaterThan(0);
+      expect(comp.bitsPerBlock).toBeGreaterThan(0);
+      expect(comp.zeroDensity).toBeGreaterThan(0);
+      expect(comp.zeroDensity).toBeLessThanOrEqual(1);
+    }
+    expect(await optim.analyze(base, {lowMemory: true})).toEqual(info);
+
+    const progressive = await optim.analyze(await optim(base, {effort: 1}));
+    expect(progressive.progressive).toBe(true);
+    expect(progressive.components).toEqual(info.components);
+  });
+
+  test("gray", async function() {
+    const info = await optim.analyze(gray);
+    expect(info.components[1].zeroDensity).toBe(1);
+    expect(info.components[2].zeroDensity).toBe(1);
+  });
 });
 
 describe("dumpdct", function() {
@@ -171,3 +599,33 @@ describe("dumpdct", function() {
     }
   });
 });
+
+describe("jxl", function() {
+  if (!optim.supportsJxl) {
+    test("unsupported", async function() {
+      await expect(optim.recompress(base)).rejects.toThrow(RangeError);
+      await expect(optim.reconstruct(base)).rejects.toThrow(RangeError);
+    });
+    return;
+  }
+
+  test("bad params", async function() {
+    await expect(optim.recompress()).rejects.toThrow(TypeError);
+    await expect(optim.reconstruct()).rejects.toThrow(TypeError);
+    await expect(optim.recompress(Buffer.from("nope"))).
+      rejects.toThrow(optim.OptimizeError);
+  });
+
+  test("roundtrip", async function() {
+    const jxl = await optim.recompress(base);
+    expect(Buffer.isBuffer(jxl)).toBe(true);
+    expect(jxl.length).toBeLessThan(base.length);
+    const jpeg = await optim.reconstruct(jxl);
+    expect(jpeg.equals(base)).toBe(true);
+  });
+
+  test("not a recompressed jpeg", async function() {
+    await expect(optim.reconstruct(base)).
+      rejects.toThrow(optim.OptimizeError);
+  });
+});